@@ -7,6 +7,7 @@
 const {Services} = ChromeUtils.import("resource://gre/modules/Services.jsm");
 const {TargetRegistry} = ChromeUtils.import("chrome://juggler/content/TargetRegistry.js");
 const {Helper} = ChromeUtils.import('chrome://juggler/content/Helper.js');
+const {screencastEncoderOptions} = ChromeUtils.import('chrome://juggler/content/protocol/PageHandler.js');
 
 const helper = new Helper();
 
@@ -20,6 +21,7 @@ class BrowserHandler {
     this._eventListeners = [];
     this._createdBrowserContextIds = new Set();
     this._attachedSessions = new Map();
+    this._compositeIds = new Set();
     this._onclose = onclose;
   }
 
@@ -77,6 +79,10 @@ class BrowserHandler {
         browserContext.destroy();
     }
     this._createdBrowserContextIds.clear();
+    const screencast = Components.classes['@mozilla.org/juggler/screencast;1'].getService(Components.interfaces.nsIScreencastService);
+    for (const compositeId of this._compositeIds)
+      screencast.stopVideoRecording(compositeId);
+    this._compositeIds.clear();
   }
 
   _shouldAttachToTarget(target) {
@@ -228,6 +234,20 @@ class BrowserHandler {
     return {cookies};
   }
 
+  startCompositeRecording({file, tileWidth, tileHeight, columns, rows, encoderOptions}) {
+    const screencast = Components.classes['@mozilla.org/juggler/screencast;1'].getService(Components.interfaces.nsIScreencastService);
+    const compositeId = screencast.startCompositeRecording(file, tileWidth, tileHeight, columns, rows, screencastEncoderOptions(encoderOptions));
+    this._compositeIds.add(compositeId);
+    return {compositeId};
+  }
+
+  stopCompositeRecording({compositeId}) {
+    if (!this._compositeIds.delete(compositeId))
+      throw new Error('No composite recording with id ' + compositeId);
+    const screencast = Components.classes['@mozilla.org/juggler/screencast;1'].getService(Components.interfaces.nsIScreencastService);
+    screencast.stopVideoRecording(compositeId);
+  }
+
   async getInfo() {
     const version = Components.classes["@mozilla.org/xre/app-info;1"]
                               .getService(Components.interfaces.nsIXULAppInfo)
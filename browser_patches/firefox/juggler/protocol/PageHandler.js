@@ -91,6 +91,7 @@ class PageHandler {
 
     this._enabled = false;
     this._videoSessionId = -1;
+    this._compositeTileId = -1;
   }
 
   _onWorkerCreated({workerId, frameId, url}) {
@@ -286,10 +287,62 @@ class PageHandler {
     return await worker.sendMessage(JSON.parse(message));
   }
 
-  startVideoRecording({file, width, height, scale}) {
+  startVideoRecording({file, stream, streamWindow, width, height, scale, encoderOptions = {}}) {
     const screencast = Cc['@mozilla.org/juggler/screencast;1'].getService(Ci.nsIScreencastService);
     const docShell = this._pageTarget._gBrowser.ownerGlobal.docShell;
-    this._videoSessionId = screencast.startVideoRecording(docShell, file);
+    const options = screencastEncoderOptions(encoderOptions);
+    let listener = null;
+    if (stream) {
+      listener = {
+        QueryInterface: ChromeUtils.generateQI([Ci.nsIScreencastStreamListener]),
+        window: streamWindow === undefined ? 4 : streamWindow,
+        onData: data => this._session.emitEvent('Page.screencastData', {data: btoa(data)}),
+        onClose: () => this._session.emitEvent('Page.screencastStreamClosed', {}),
+      };
+    }
+    this._videoSessionId = screencast.startVideoRecording(docShell, file || '', width, height, scale || 0, options, listener);
+  }
+
+  screencastDataAck() {
+    if (this._videoSessionId === -1)
+      throw new Error('No video recording in progress');
+    const screencast = Cc['@mozilla.org/juggler/screencast;1'].getService(Ci.nsIScreencastService);
+    screencast.ackVideoStream(this._videoSessionId);
+  }
+
+  getVideoRecordingStats() {
+    if (this._videoSessionId === -1)
+      throw new Error('No video recording in progress');
+    const screencast = Cc['@mozilla.org/juggler/screencast;1'].getService(Ci.nsIScreencastService);
+    const stats = screencast.getVideoRecordingStats(this._videoSessionId);
+    return {
+      stats: {
+        encoder: stats.encoder,
+        framesCaptured: stats.framesCaptured,
+        framesEncoded: stats.framesEncoded,
+        framesDropped: stats.framesDropped,
+        maxQueueDepth: stats.maxQueueDepth,
+        bytesWritten: stats.bytesWritten,
+        histogramBounds: stats.histogramBounds,
+        captureToEncodeLatency: stats.captureToEncodeLatency,
+        encodeTime: stats.encodeTime,
+        writeTime: stats.writeTime,
+      },
+    };
+  }
+
+  async getVideoRecordingScreenshot({mimeType, maxWidth, maxHeight, quality}) {
+    if (this._videoSessionId === -1)
+      throw new Error('No video recording in progress');
+    const screencast = Cc['@mozilla.org/juggler/screencast;1'].getService(Ci.nsIScreencastService);
+    const data = await new Promise((resolve, reject) => {
+      screencast.captureVideoRecordingFrame(this._videoSessionId, mimeType, maxWidth || 0, maxHeight || 0, quality || 0, {
+        QueryInterface: ChromeUtils.generateQI([Ci.nsIScreencastScreenshotListener]),
+        onScreenshot: resolve,
+        onError: error => reject(new Error(error)),
+      });
+    });
+    return {data: btoa(data)};
   }
 
   stopVideoRecording() {
@@ -300,6 +353,43 @@ class PageHandler {
     const screencast = Cc['@mozilla.org/juggler/screencast;1'].getService(Ci.nsIScreencastService);
     screencast.stopVideoRecording(videoSessionId);
   }
+
+  startCompositeTile({compositeId}) {
+    if (this._compositeTileId !== -1)
+      throw new Error('The page is already in a composite recording');
+    const screencast = Cc['@mozilla.org/juggler/screencast;1'].getService(Ci.nsIScreencastService);
+    const docShell = this._pageTarget._gBrowser.ownerGlobal.docShell;
+    this._compositeTileId = screencast.addCompositeTile(compositeId, docShell);
+  }
+
+  stopCompositeTile() {
+    if (this._compositeTileId === -1)
+      throw new Error('The page is not in a composite recording');
+    const tileId = this._compositeTileId;
+    this._compositeTileId = -1;
+    const screencast = Cc['@mozilla.org/juggler/screencast;1'].getService(Ci.nsIScreencastService);
+    screencast.stopVideoRecording(tileId);
+  }
+}
+
+function screencastEncoderOptions(encoderOptions = {}) {
+  return {
+    QueryInterface: ChromeUtils.generateQI([Ci.nsIScreencastEncoderOptions]),
+    codec: encoderOptions.codec || 'vp8',
+    container: encoderOptions.container || 'ivf',
+    bitrate: encoderOptions.bitrate || 0,
+    cpuUsed: encoderOptions.cpuUsed || 0,
+    threads: encoderOptions.threads || 0,
+    tokenPartitions: encoderOptions.tokenPartitions || 0,
+    keyframeInterval: encoderOptions.keyframeInterval || 0,
+    maxPendingFrames: encoderOptions.maxPendingFrames || 0,
+    outputBufferSize: encoderOptions.outputBufferSize || 0,
+    preallocateSize: encoderOptions.preallocateSize || 0,
+    directIO: !!encoderOptions.directIO,
+    minFrameRate: encoderOptions.minFrameRate || 0,
+    maxFrameRate: encoderOptions.maxFrameRate || 0,
+    checkpointInterval: encoderOptions.checkpointInterval || 0,
+  };
 }
 
 class Dialog {
@@ -357,5 +447,6 @@ class Dialog {
   }
 }
 
-var EXPORTED_SYMBOLS = ['PageHandler'];
+var EXPORTED_SYMBOLS = ['PageHandler', 'screencastEncoderOptions'];
 this.PageHandler = PageHandler;
+this.screencastEncoderOptions = screencastEncoderOptions;
@@ -97,6 +97,41 @@ pageTypes.Clip = {
   height: t.Number,
 };
 
+pageTypes.VideoEncoderOptions = {
+  codec: t.Optional(t.Enum(['vp8', 'vp9'])),
+  container: t.Optional(t.Enum(['ivf', 'webm'])),
+  // Target bitrate in kbps.
+  bitrate: t.Optional(t.Number),
+  cpuUsed: t.Optional(t.Number),
+  threads: t.Optional(t.Number),
+  tokenPartitions: t.Optional(t.Number),
+  keyframeInterval: t.Optional(t.Number),
+  maxPendingFrames: t.Optional(t.Number),
+  // Output file write-behind buffer size in bytes.
+  outputBufferSize: t.Optional(t.Number),
+  preallocateSize: t.Optional(t.Number),
+  directIO: t.Optional(t.Boolean),
+  // Capture rate bounds, the rate adapts to page activity and encoder load.
+  minFrameRate: t.Optional(t.Number),
+  maxFrameRate: t.Optional(t.Number),
+  // Frames between header updates that keep the file recoverable.
+  checkpointInterval: t.Optional(t.Number),
+};
+
+pageTypes.VideoRecordingStats = {
+  encoder: t.String,
+  framesCaptured: t.Number,
+  framesEncoded: t.Number,
+  framesDropped: t.Number,
+  maxQueueDepth: t.Number,
+  bytesWritten: t.Number,
+  // Upper bounds of the histogram buckets in ms, the last bucket is unbounded.
+  histogramBounds: t.Array(t.Number),
+  captureToEncodeLatency: t.Array(t.Number),
+  encodeTime: t.Array(t.Number),
+  writeTime: t.Array(t.Number),
+};
+
 
 const runtimeTypes = {};
 runtimeTypes.RemoteObject = {
@@ -395,6 +430,28 @@ const Browser = {
         colorScheme: t.Nullable(t.Enum(['dark', 'light', 'no-preference'])),
       },
     },
+    // Records several pages into one video: a grid of |columns| x |rows|
+    // cells, pages join it with Page.startCompositeTile. The cells each page
+    // occupied are stored in the PLAYWRIGHT_TILES tag of WebM files, or next
+    // to the file as |file|.tiles.json for IVF.
+    'startCompositeRecording': {
+      params: {
+        file: t.String,
+        tileWidth: t.Number,
+        tileHeight: t.Number,
+        columns: t.Number,
+        rows: t.Number,
+        encoderOptions: t.Optional(pageTypes.VideoEncoderOptions),
+      },
+      returns: {
+        compositeId: t.Number,
+      },
+    },
+    'stopCompositeRecording': {
+      params: {
+        compositeId: t.Number,
+      },
+    },
   },
 };
 
@@ -628,6 +685,12 @@ const Page = {
       workerId: t.String,
       message: t.String,
     },
+    'screencastData': {
+      // Base64-encoded chunk of the stream in the recording's container,
+      // ends at a frame boundary.
+      data: t.String,
+    },
+    'screencastStreamClosed': {},
   },
 
   methods: {
@@ -827,14 +890,49 @@ const Page = {
     },
     'startVideoRecording': {
       params: {
-        file: t.String,
+        // At least one of |file| and |stream| is required.
+        file: t.Optional(t.String),
+        // Deliver the video incrementally with Page.screencastData events.
+        stream: t.Optional(t.Boolean),
+        // Maximum number of unacknowledged Page.screencastData events.
+        streamWindow: t.Optional(t.Number),
         width: t.Number,
         height: t.Number,
         scale: t.Optional(t.Number),
+        encoderOptions: t.Optional(pageTypes.VideoEncoderOptions),
       },
     },
     'stopVideoRecording': {
     },
+    'screencastDataAck': {
+    },
+    // The last frame captured by the video recording, at the window size.
+    // Cheaper than screenshot but may lag behind the page by a frame.
+    'getVideoRecordingScreenshot': {
+      params: {
+        mimeType: t.Enum(['image/png', 'image/jpeg']),
+        maxWidth: t.Optional(t.Number),
+        maxHeight: t.Optional(t.Number),
+        quality: t.Optional(t.Number),
+      },
+      returns: {
+        data: t.String,
+      },
+    },
+    'getVideoRecordingStats': {
+      returns: {
+        stats: pageTypes.VideoRecordingStats,
+      },
+    },
+    // Shows the page in a free cell of a Browser.startCompositeRecording
+    // video, until stopCompositeTile or the end of the recording.
+    'startCompositeTile': {
+      params: {
+        compositeId: t.Number,
+      },
+    },
+    'stopCompositeTile': {
+    },
   },
 };
 
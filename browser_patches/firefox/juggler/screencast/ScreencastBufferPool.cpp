@@ -0,0 +1,63 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ScreencastBufferPool.h"
+
+#include <algorithm>
+#include "mozilla/MathAlgorithms.h"
+
+namespace mozilla {
+
+void ScreencastBufferPool::Buffer::release()
+{
+    if (m_pool && m_data)
+        m_pool->recycle(std::move(m_data), m_capacity);
+    m_pool = nullptr;
+    m_data = nullptr;
+}
+
+ScreencastBufferPool::ScreencastBufferPool(size_t maxFreeBytes)
+    : m_maxFreeBytes(maxFreeBytes)
+    , m_lock("ScreencastBufferPool::m_lock")
+{
+}
+
+// static
+size_t ScreencastBufferPool::sizeClass(size_t size)
+{
+    // Small sizes would get classes of a few bytes.
+    size = std::max<size_t>(size, 64);
+    size_t step = (size_t(1) << FloorLog2Size(size)) / 8;
+    return (size + step - 1) & ~(step - 1);
+}
+
+ScreencastBufferPool::Buffer ScreencastBufferPool::acquire(size_t size)
+{
+    Buffer buffer;
+    buffer.m_pool = this;
+    buffer.m_capacity = sizeClass(size);
+    {
+        MutexAutoLock lock(m_lock);
+        auto it = m_freeBuffers.find(buffer.m_capacity);
+        if (it != m_freeBuffers.end() && !it->second.empty()) {
+            buffer.m_data = std::move(it->second.back());
+            it->second.pop_back();
+            m_freeBytes -= buffer.m_capacity;
+            return buffer;
+        }
+    }
+    buffer.m_data.reset(new uint8_t[buffer.m_capacity]);
+    return buffer;
+}
+
+void ScreencastBufferPool::recycle(std::unique_ptr<uint8_t[]>&& data, size_t capacity)
+{
+    MutexAutoLock lock(m_lock);
+    if (m_freeBytes + capacity > m_maxFreeBytes)
+        return;
+    m_freeBuffers[capacity].push_back(std::move(data));
+    m_freeBytes += capacity;
+}
+
+} // namespace mozilla
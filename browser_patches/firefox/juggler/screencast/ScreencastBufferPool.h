@@ -0,0 +1,69 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <vector>
+#include "mozilla/Mutex.h"
+#include "mozilla/RefPtr.h"
+#include "nsISupportsImpl.h"
+
+namespace mozilla {
+
+// Recycles the large frame buffers of the screencast pipeline across frames
+// and sessions. Sizes are rounded up to one of eight classes per power of
+// two, so that sessions of similar sizes share buckets while wasting at most
+// an eighth of a buffer. Can be used from any thread.
+class ScreencastBufferPool {
+    NS_INLINE_DECL_THREADSAFE_REFCOUNTING(ScreencastBufferPool)
+public:
+    // Returns its memory to the pool when destroyed.
+    class Buffer {
+    public:
+        Buffer() = default;
+        Buffer(Buffer&&) = default;
+        Buffer& operator=(Buffer&& other)
+        {
+            release();
+            m_pool = std::move(other.m_pool);
+            m_data = std::move(other.m_data);
+            m_capacity = other.m_capacity;
+            return *this;
+        }
+        ~Buffer() { release(); }
+
+        uint8_t* get() const { return m_data.get(); }
+
+    private:
+        friend class ScreencastBufferPool;
+        void release();
+
+        RefPtr<ScreencastBufferPool> m_pool;
+        std::unique_ptr<uint8_t[]> m_data;
+        size_t m_capacity { 0 };
+    };
+
+    // |maxFreeBytes| bounds the memory kept for reuse.
+    explicit ScreencastBufferPool(size_t maxFreeBytes = 64 << 20);
+
+    // The contents of the returned buffer are undefined.
+    Buffer acquire(size_t size);
+
+private:
+    ~ScreencastBufferPool() = default;
+
+    static size_t sizeClass(size_t size);
+
+    void recycle(std::unique_ptr<uint8_t[]>&& data, size_t capacity);
+
+    const size_t m_maxFreeBytes;
+    Mutex m_lock;
+    // Guarded by m_lock.
+    std::map<size_t, std::vector<std::unique_ptr<uint8_t[]>>> m_freeBuffers;
+    size_t m_freeBytes { 0 };
+};
+
+} // namespace mozilla
@@ -0,0 +1,459 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ScreencastCapturer.h"
+
+#include <algorithm>
+#include <inttypes.h>
+#include <libyuv.h>
+#include "ScreencastBufferPool.h"
+#include "gfxPlatform.h"
+#include "mozilla/Atomics.h"
+#include "mozilla/Mutex.h"
+#include "mozilla/Range.h"
+#include "mozilla/TaskQueue.h"
+#include "mozilla/TimeStamp.h"
+#include "mozilla/gfx/2D.h"
+#include "mozilla/layers/CompositorBridgeParent.h"
+#include "mozilla/layers/CompositorThread.h"
+#include "mozilla/layers/WebRenderBridgeParent.h"
+#include "mozilla/webrender/WebRenderAPI.h"
+#include "mozilla/widget/CompositorWidget.h"
+#include "nsINamed.h"
+#include "nsITimer.h"
+#include "nsIWidget.h"
+#include "nsString.h"
+#include "nsThreadUtils.h"
+#include "webrtc/api/video/i420_buffer.h"
+#include "webrtc/common_video/include/i420_buffer_pool.h"
+#include "webrtc/api/video/video_frame.h"
+#include "webrtc/modules/desktop_capture/desktop_capture_options.h"
+#include "webrtc/modules/desktop_capture/desktop_capturer.h"
+#include "webrtc/modules/desktop_capture/desktop_frame.h"
+#include "mozilla/widget/PlatformWidgetTypes.h"
+
+namespace mozilla {
+
+#ifdef XP_MACOSX
+// Implemented in ScreencastCapturerCocoa.mm.
+bool GetCocoaWindowId(nsIWidget* aWidget, webrtc::DesktopCapturer::SourceId& aWindowId);
+#endif
+
+namespace {
+
+// Returns the id the webrtc window capturer knows the widget's native
+// window by.
+bool GetNativeWindowId(nsIWidget* aWidget, webrtc::DesktopCapturer::SourceId& aWindowId) {
+  // Headless widgets are not backed by a native window.
+  if (gfxPlatform::IsHeadless())
+    return false;
+#if defined(MOZ_WIDGET_GTK) && defined(MOZ_X11)
+  mozilla::widget::CompositorWidgetInitData initData;
+  aWidget->GetCompositorWidgetInitData(&initData);
+  // Wayland windows have no X11 window to grab.
+  if (initData.type() != mozilla::widget::CompositorWidgetInitData::TGtkCompositorWidgetInitData ||
+      !initData.get_GtkCompositorWidgetInitData().XWindow())
+    return false;
+  aWindowId = static_cast<webrtc::DesktopCapturer::SourceId>(initData.get_GtkCompositorWidgetInitData().XWindow());
+  return true;
+#elif defined(XP_WIN)
+  void* hwnd = aWidget->GetNativeData(NS_NATIVE_WINDOW);
+  if (!hwnd)
+    return false;
+  aWindowId = reinterpret_cast<webrtc::DesktopCapturer::SourceId>(hwnd);
+  return true;
+#elif defined(XP_MACOSX)
+  return GetCocoaWindowId(aWidget, aWindowId);
+#else
+  return false;
+#endif
+}
+
+// Drives the webrtc window capturer on a thread of its own. DesktopCaptureImpl
+// would allocate a new I420 buffer for every frame, the frames are converted
+// into pooled buffers here instead. Like CompositorReadback, the state is
+// shared with the capture thread so that Stop() does not have to join it.
+class WindowCapture final : public nsITimerCallback, public nsINamed, public webrtc::DesktopCapturer::Callback {
+ public:
+  NS_DECL_THREADSAFE_ISUPPORTS
+
+  WindowCapture(webrtc::DesktopCapturer::SourceId aWindowId, int aMaxFPS)
+      : mWindowId(aWindowId)
+      , mMaxFPS(aMaxFPS)
+      , mFrameIntervalUs(1000000 / aMaxFPS)
+      , mSinkLock("WindowCapture::mSinkLock") {
+  }
+
+  bool Start(ScreencastCapturer::Sink* aSink) {
+    MOZ_ASSERT(NS_IsMainThread());
+    nsresult rv = NS_NewNamedThread("Screencast win", getter_AddRefs(mThread));
+    if (NS_FAILED(rv)) {
+      fprintf(stderr, "WindowCapturer failed to create thread %d\n", rv);
+      return false;
+    }
+    {
+      MutexAutoLock lock(mSinkLock);
+      mSink = aSink;
+    }
+    mStartTime = TimeStamp::Now();
+    RefPtr<WindowCapture> self = this;
+    mThread->Dispatch(NS_NewRunnableFunction("WindowCapturer::Start", [self] {
+      self->StartOnThread();
+    }));
+    return true;
+  }
+
+  void Stop() {
+    MOZ_ASSERT(NS_IsMainThread());
+    {
+      MutexAutoLock lock(mSinkLock);
+      mSink = nullptr;
+    }
+    if (!mThread)
+      return;
+    RefPtr<WindowCapture> self = this;
+    mThread->Dispatch(NS_NewRunnableFunction("WindowCapturer::Stop", [self] {
+      self->StopOnThread();
+    }));
+    // The thread is joined from the main thread's event loop.
+    mThread->AsyncShutdown();
+    mThread = nullptr;
+  }
+
+  void SetFrameRate(double aFPS) {
+    mFrameIntervalUs = static_cast<int32_t>(1000000 / std::min<double>(aFPS, mMaxFPS));
+  }
+
+  NS_IMETHOD Notify(nsITimer* aTimer) override {
+    CaptureFrame();
+    return NS_OK;
+  }
+
+  NS_IMETHOD GetName(nsACString& aName) override {
+    aName.AssignLiteral("WindowCapturer");
+    return NS_OK;
+  }
+
+  // Called on the capture thread from within CaptureFrame().
+  void OnCaptureResult(webrtc::DesktopCapturer::Result aResult, std::unique_ptr<webrtc::DesktopFrame> aFrame) override {
+    if (aResult != webrtc::DesktopCapturer::Result::SUCCESS || !aFrame)
+      return;
+    // I420 frames must have even dimensions. The window size is followed,
+    // the encoder scales the frames to the output size.
+    const int width = aFrame->size().width() & ~1;
+    const int height = aFrame->size().height() & ~1;
+    if (width <= 0 || height <= 0)
+      return;
+    // Buffers return to the pool once the encoder is done with them.
+    rtc::scoped_refptr<webrtc::I420Buffer> buffer = mBufferPool.CreateBuffer(width, height);
+    if (!buffer)
+      return;
+    // Desktop frames are B8G8R8A8, which libyuv calls ARGB.
+    libyuv::ARGBToI420(aFrame->data(), aFrame->stride(),
+                       buffer->MutableDataY(), buffer->StrideY(),
+                       buffer->MutableDataU(), buffer->StrideU(),
+                       buffer->MutableDataV(), buffer->StrideV(),
+                       width, height);
+    int64_t timestampUs = static_cast<int64_t>((TimeStamp::Now() - mStartTime).ToMicroseconds());
+    webrtc::VideoFrame frame(buffer, webrtc::kVideoRotation_0, timestampUs);
+    MutexAutoLock lock(mSinkLock);
+    if (mSink)
+      mSink->OnFrame(frame);
+  }
+
+ private:
+  ~WindowCapture() override = default;
+
+  void StartOnThread() {
+    webrtc::DesktopCaptureOptions options = webrtc::DesktopCaptureOptions::CreateDefault();
+#ifdef XP_WIN
+    // While the window is on top and not occluded, crop it out of the DXGI
+    // desktop duplication, which the GPU keeps up to date. GDI window
+    // capture with its per-frame BitBlt is only the fallback.
+    options.set_allow_directx_capturer(true);
+    options.set_allow_cropping_window_capturer(true);
+#endif
+    mCapturer = webrtc::DesktopCapturer::CreateWindowCapturer(options);
+    if (!mCapturer || !mCapturer->SelectSource(mWindowId)) {
+      fprintf(stderr, "WindowCapturer cannot capture window %" PRIdPTR "\n", mWindowId);
+      mCapturer = nullptr;
+      return;
+    }
+    mCapturer->Start(this);
+    nsresult rv = NS_NewTimerWithCallback(getter_AddRefs(mTimer), this, 1000 / mMaxFPS,
+                                          nsITimer::TYPE_REPEATING_SLACK, GetCurrentThreadSerialEventTarget());
+    if (NS_FAILED(rv)) {
+      fprintf(stderr, "WindowCapturer failed to create timer %d\n", rv);
+      return;
+    }
+    CaptureFrame();
+  }
+
+  void StopOnThread() {
+    if (mTimer) {
+      mTimer->Cancel();
+      mTimer = nullptr;
+    }
+    mCapturer = nullptr;
+  }
+
+  void CaptureFrame() {
+    if (!mCapturer)
+      return;
+    // The timer runs at the maximum rate. Allow for timer jitter when
+    // capturing at a lower one.
+    TimeStamp now = TimeStamp::Now();
+    if (!mLastCapture.IsNull() && (now - mLastCapture).ToMicroseconds() < mFrameIntervalUs * 0.8)
+      return;
+    mLastCapture = now;
+    mCapturer->CaptureFrame();
+  }
+
+  const webrtc::DesktopCapturer::SourceId mWindowId;
+  const int mMaxFPS;
+  // Set on the frame delivery thread, read on the capture thread.
+  Atomic<int32_t> mFrameIntervalUs;
+  // Used on the main thread only.
+  nsCOMPtr<nsIThread> mThread;
+  // Set on the main thread before the capture thread starts.
+  TimeStamp mStartTime;
+  // Used on the capture thread only.
+  std::unique_ptr<webrtc::DesktopCapturer> mCapturer;
+  nsCOMPtr<nsITimer> mTimer;
+  TimeStamp mLastCapture;
+  webrtc::I420BufferPool mBufferPool;
+
+  Mutex mSinkLock;
+  // Guarded by mSinkLock.
+  ScreencastCapturer::Sink* mSink = nullptr;
+};
+
+NS_IMPL_ISUPPORTS(WindowCapture, nsITimerCallback, nsINamed)
+
+// Reads the composited output of the widget back on the compositor thread,
+// the way widget snapshots are taken, but without a round-trip through the
+// main thread. The readback follows the size of the widget, the encoder
+// scales the frames to the output size. Timer callbacks and conversion tasks
+// keep a reference, so the state outlives the capturer when Stop() does not
+// wait for them.
+class CompositorReadback final : public nsITimerCallback, public nsINamed {
+ public:
+  NS_DECL_THREADSAFE_ISUPPORTS
+
+  CompositorReadback(layers::LayersId aLayersId, nsIEventTarget* aConversionPool, ScreencastBufferPool* aBufferPool, int aMaxFPS)
+      : mLayersId(aLayersId)
+      , mConversionQueue(new TaskQueue(do_AddRef(aConversionPool), "CompositorCapturer"))
+      , mBufferPool(aBufferPool)
+      , mMaxFPS(aMaxFPS)
+      , mFrameIntervalUs(1000000 / aMaxFPS)
+      , mSinkLock("CompositorReadback::mSinkLock") {
+  }
+
+  bool Start(ScreencastCapturer::Sink* aSink) {
+    MOZ_ASSERT(NS_IsMainThread());
+    {
+      MutexAutoLock lock(mSinkLock);
+      mSink = aSink;
+    }
+    mStartTime = TimeStamp::Now();
+    nsresult rv = NS_NewTimerWithCallback(getter_AddRefs(mTimer), this, 1000 / mMaxFPS,
+                                          nsITimer::TYPE_REPEATING_SLACK, layers::CompositorThread());
+    if (NS_FAILED(rv)) {
+      fprintf(stderr, "CompositorCapturer failed to create timer %d\n", rv);
+      return false;
+    }
+    // Capture the first frame right away rather than after one interval.
+    RefPtr<CompositorReadback> self = this;
+    layers::CompositorThread()->Dispatch(NS_NewRunnableFunction("CompositorCapturer::Start", [self] {
+      self->CaptureFrame();
+    }));
+    return true;
+  }
+
+  // Does not wait for the compositor thread or the conversion queue, only
+  // for a frame that is being handed to the sink right now.
+  void Stop() {
+    MOZ_ASSERT(NS_IsMainThread());
+    mStopped = true;
+    if (mTimer) {
+      mTimer->Cancel();
+      mTimer = nullptr;
+    }
+    {
+      MutexAutoLock lock(mSinkLock);
+      mSink = nullptr;
+    }
+    mConversionQueue->BeginShutdown();
+  }
+
+  void SetFrameRate(double aFPS) {
+    mFrameIntervalUs = static_cast<int32_t>(1000000 / std::min<double>(aFPS, mMaxFPS));
+  }
+
+  NS_IMETHOD Notify(nsITimer* aTimer) override {
+    CaptureFrame();
+    return NS_OK;
+  }
+
+  NS_IMETHOD GetName(nsACString& aName) override {
+    aName.AssignLiteral("CompositorCapturer");
+    return NS_OK;
+  }
+
+ private:
+  ~CompositorReadback() override = default;
+
+  void CaptureFrame() {
+    MOZ_ASSERT(layers::CompositorThreadHolder::IsInCompositorThread());
+    // When conversion or encoding is slow the previous frame simply lasts
+    // longer.
+    if (mStopped || mConverting)
+      return;
+    // The timer runs at the maximum rate. Allow for timer jitter when
+    // capturing at a lower one.
+    TimeStamp now = TimeStamp::Now();
+    if (!mLastCapture.IsNull() && (now - mLastCapture).ToMicroseconds() < mFrameIntervalUs * 0.8)
+      return;
+
+    layers::CompositorBridgeParent* bridge = layers::CompositorBridgeParent::GetCompositorBridgeParentFromLayersId(mLayersId);
+    if (!bridge || !bridge->GetWidget())
+      return;
+    LayoutDeviceIntSize widgetSize = bridge->GetWidget()->GetClientSize();
+    // I420 frames must have even dimensions.
+    gfx::IntSize size(widgetSize.width & ~1, widgetSize.height & ~1);
+    if (size.IsEmpty())
+      return;
+
+    const int stride = size.width * 4;
+    ScreencastBufferPool::Buffer pixels = mBufferPool->acquire(stride * size.height);
+    bool flipped = false;
+    if (!Readback(bridge, pixels.get(), size, stride, flipped))
+      return;
+    mLastCapture = now;
+
+    int64_t timestampUs = static_cast<int64_t>((now - mStartTime).ToMicroseconds());
+    mConverting = true;
+    RefPtr<CompositorReadback> self = this;
+    mConversionQueue->Dispatch(NS_NewRunnableFunction("CompositorCapturer::CaptureFrame", [self, pixels = std::move(pixels), size, stride, flipped, timestampUs]() mutable {
+      self->DeliverFrame(pixels.get(), size, stride, flipped, timestampUs);
+      // Back to the pool before the next readback asks for a buffer.
+      pixels = ScreencastBufferPool::Buffer();
+      self->mConverting = false;
+    }));
+  }
+
+  // Composites the current layer tree or WebRender scene into |aData|,
+  // B8G8R8A8 with |aStride| bytes per row.
+  static bool Readback(layers::CompositorBridgeParent* aBridge, uint8_t* aData, const gfx::IntSize& aSize, int aStride, bool& aFlipped) {
+    if (layers::WebRenderBridgeParent* wrBridge = aBridge->GetWrBridge()) {
+      wr::WebRenderAPI* api = wrBridge->GetWebRenderAPI();
+      if (!api)
+        return false;
+      api->Readback(TimeStamp::Now(), aSize, gfx::SurfaceFormat::B8G8R8A8, Range<uint8_t>(aData, aStride * aSize.height));
+      // GL reads rows bottom-up.
+      aFlipped = true;
+      return true;
+    }
+
+    RefPtr<gfx::DrawTarget> target = gfx::Factory::CreateDrawTargetForData(
+        gfx::BackendType::SKIA, aData, aSize, aStride, gfx::SurfaceFormat::B8G8R8A8);
+    if (!target)
+      return false;
+    aBridge->ForceComposeToTarget(target);
+    aFlipped = false;
+    return true;
+  }
+
+  void DeliverFrame(const uint8_t* aData, const gfx::IntSize& aSize, int aStride, bool aFlipped, int64_t aTimestampUs) {
+    // Buffers return to the pool once the encoder is done with them.
+    rtc::scoped_refptr<webrtc::I420Buffer> buffer = mI420Pool.CreateBuffer(aSize.width, aSize.height);
+    if (!buffer)
+      return;
+    // B8G8R8A8 is what libyuv calls ARGB on little-endian hosts. A negative
+    // height flips the image.
+    libyuv::ARGBToI420(aData, aStride,
+                       buffer->MutableDataY(), buffer->StrideY(),
+                       buffer->MutableDataU(), buffer->StrideU(),
+                       buffer->MutableDataV(), buffer->StrideV(),
+                       aSize.width, aFlipped ? -aSize.height : aSize.height);
+    webrtc::VideoFrame frame(buffer, webrtc::kVideoRotation_0, aTimestampUs);
+    MutexAutoLock lock(mSinkLock);
+    if (mSink)
+      mSink->OnFrame(frame);
+  }
+
+  const layers::LayersId mLayersId;
+  RefPtr<TaskQueue> mConversionQueue;
+  RefPtr<ScreencastBufferPool> mBufferPool;
+  const int mMaxFPS;
+  // Set on the frame delivery thread, read on the compositor thread.
+  Atomic<int32_t> mFrameIntervalUs;
+  Atomic<bool> mStopped { false };
+  Atomic<bool> mConverting { false };
+  // Used on the main thread only.
+  nsCOMPtr<nsITimer> mTimer;
+  // Set on the main thread before the first capture.
+  TimeStamp mStartTime;
+  // Used on the compositor thread only.
+  TimeStamp mLastCapture;
+  // Used on the conversion queue only.
+  webrtc::I420BufferPool mI420Pool;
+
+  Mutex mSinkLock;
+  // Guarded by mSinkLock.
+  ScreencastCapturer::Sink* mSink = nullptr;
+};
+
+NS_IMPL_ISUPPORTS(CompositorReadback, nsITimerCallback, nsINamed)
+
+// Owns the state shared with the capture threads on behalf of the session.
+template <typename Capture>
+class SharedStateCapturer final : public ScreencastCapturer {
+ public:
+  explicit SharedStateCapturer(RefPtr<Capture>&& aCapture)
+      : mCapture(std::move(aCapture)) {
+  }
+
+  ~SharedStateCapturer() override {
+    Stop();
+  }
+
+  bool Start(Sink* aSink) override {
+    return mCapture->Start(aSink);
+  }
+
+  void Stop() override {
+    mCapture->Stop();
+  }
+
+  void SetFrameRate(double aFPS) override {
+    mCapture->SetFrameRate(aFPS);
+  }
+
+ private:
+  RefPtr<Capture> mCapture;
+};
+
+}  // namespace
+
+// static
+std::unique_ptr<ScreencastCapturer> ScreencastCapturer::CreateWindowCapturer(nsIWidget* aWidget, int aMaxFPS) {
+  webrtc::DesktopCapturer::SourceId windowId;
+  if (!GetNativeWindowId(aWidget, windowId))
+    return nullptr;
+  return std::make_unique<SharedStateCapturer<WindowCapture>>(MakeRefPtr<WindowCapture>(windowId, aMaxFPS));
+}
+
+// static
+std::unique_ptr<ScreencastCapturer> ScreencastCapturer::CreateCompositorCapturer(nsIWidget* aWidget, nsIEventTarget* aConversionPool, ScreencastBufferPool* aBufferPool, int aMaxFPS) {
+  // With a GPU process the compositor runs elsewhere.
+  if (!layers::CompositorThread())
+    return nullptr;
+  layers::LayersId layersId = aWidget->GetRootLayerTreeId();
+  if (!layersId.IsValid())
+    return nullptr;
+  return std::make_unique<SharedStateCapturer<CompositorReadback>>(MakeRefPtr<CompositorReadback>(layersId, aConversionPool, aBufferPool, aMaxFPS));
+}
+
+}  // namespace mozilla
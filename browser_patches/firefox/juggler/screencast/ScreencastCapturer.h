@@ -0,0 +1,58 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <memory>
+#include "nsStringFwd.h"
+
+class nsIEventTarget;
+class nsIWidget;
+
+namespace rtc {
+template <typename VideoFrameT>
+class VideoSinkInterface;
+}
+
+namespace webrtc {
+class VideoFrame;
+}
+
+namespace mozilla {
+
+class ScreencastBufferPool;
+
+// Source of the frames of a recording. Start and Stop are called on the main
+// thread. Frames are delivered to the sink one at a time, but not
+// necessarily on the same thread, and never after Stop returns.
+class ScreencastCapturer {
+ public:
+  using Sink = rtc::VideoSinkInterface<webrtc::VideoFrame>;
+
+  virtual ~ScreencastCapturer() = default;
+
+  virtual bool Start(Sink* aSink) = 0;
+  virtual void Stop() = 0;
+
+  // Lets the capturer produce no more than |aFPS| frames per second, to
+  // save the capture cost of frames the sink would skip. Called on the
+  // frame delivery thread.
+  virtual void SetFrameRate(double aFPS) {}
+
+  // Grabs the native window of |aWidget| from the system compositor through
+  // the webrtc desktop capturer: X11 and Windows windows and Cocoa windows
+  // on macOS. On Windows the window is cropped out of the DXGI desktop
+  // duplication whenever it is fully visible. Frames have the size of the
+  // window. Returns null if the widget has no such window.
+  static std::unique_ptr<ScreencastCapturer> CreateWindowCapturer(nsIWidget* aWidget, int aMaxFPS);
+
+  // Reads the composited frames of |aWidget| back from the compositor on the
+  // compositor thread and converts them to I420 on |aConversionPool|, with
+  // the readback buffers taken from |aBufferPool|. Needs no native window,
+  // so it also works headless and on Wayland. Returns null when the
+  // compositor runs in the GPU process.
+  static std::unique_ptr<ScreencastCapturer> CreateCompositorCapturer(nsIWidget* aWidget, nsIEventTarget* aConversionPool, ScreencastBufferPool* aBufferPool, int aMaxFPS);
+};
+
+}  // namespace mozilla
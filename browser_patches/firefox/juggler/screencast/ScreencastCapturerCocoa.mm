@@ -0,0 +1,22 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#import <Cocoa/Cocoa.h>
+
+#include "nsIWidget.h"
+#include "webrtc/modules/desktop_capture/desktop_capturer.h"
+
+namespace mozilla {
+
+// The webrtc window capturer identifies windows by their CGWindowID, which
+// is the window number of the NSWindow.
+bool GetCocoaWindowId(nsIWidget* aWidget, webrtc::DesktopCapturer::SourceId& aWindowId) {
+  NSWindow* window = static_cast<NSWindow*>(aWidget->GetNativeData(NS_NATIVE_WINDOW));
+  if (!window || [window windowNumber] <= 0)
+    return false;
+  aWindowId = static_cast<webrtc::DesktopCapturer::SourceId>([window windowNumber]);
+  return true;
+}
+
+}  // namespace mozilla
@@ -0,0 +1,225 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ScreencastCompositor.h"
+
+#include <libyuv.h>
+#include "ScreencastEncoder.h"
+#include "nsThreadUtils.h"
+#include "webrtc/api/video/video_frame.h"
+
+namespace mozilla {
+
+const char ScreencastCompositor::kLayoutTag[] = "PLAYWRIGHT_TILES";
+
+ScreencastCompositor::ScreencastCompositor(RefPtr<ScreencastEncoder>&& encoder, int tileWidth, int tileHeight, int columns, int rows, int maxFPS, const nsCString& layoutPath, nsIEventTarget* ioPool)
+    : m_encoder(std::move(encoder))
+    , m_tileWidth(tileWidth)
+    , m_tileHeight(tileHeight)
+    , m_columns(columns)
+    , m_rows(rows)
+    , m_frameInterval(TimeDuration::FromSeconds(1.0 / maxFPS))
+    , m_layoutPath(layoutPath)
+    , m_ioPool(ioPool)
+    , m_startTime(TimeStamp::Now())
+    , m_cells(new Cell[columns * rows])
+    , m_lock("ScreencastCompositor::m_lock")
+    , m_emitLock("ScreencastCompositor::m_emitLock")
+{
+}
+
+ScreencastCompositor::~ScreencastCompositor() = default;
+
+int ScreencastCompositor::addTile(int sessionId)
+{
+    MutexAutoLock lock(m_lock);
+    for (int cell = 0; cell < m_columns * m_rows; ++cell) {
+        if (m_cells[cell].sessionId != -1)
+            continue;
+        m_cells[cell].sessionId = sessionId;
+        m_layout.push_back(LayoutEntry { sessionId, cell, elapsedMs(), -1 });
+        return cell;
+    }
+    return -1;
+}
+
+void ScreencastCompositor::removeTile(int cell)
+{
+    {
+        MutexAutoLock lock(m_lock);
+        for (LayoutEntry& entry : m_layout) {
+            if (entry.cell == cell && entry.endMs < 0)
+                entry.endMs = elapsedMs();
+        }
+        m_cells[cell].sessionId = -1;
+        m_cells[cell].frame = nullptr;
+        m_dirty = true;
+    }
+    emitFrame(true);
+}
+
+void ScreencastCompositor::onTileFrame(int cell, const webrtc::VideoFrame& frame)
+{
+    rtc::scoped_refptr<webrtc::I420BufferInterface> src = frame.video_frame_buffer()->ToI420();
+    if (!src)
+        return;
+
+    Cell& target = m_cells[cell];
+    int sessionId;
+    {
+        MutexAutoLock lock(m_lock);
+        sessionId = target.sessionId;
+        if (sessionId == -1)
+            return;
+    }
+
+    // Scale outside of m_lock, so that the tiles do not wait for each other.
+    rtc::scoped_refptr<webrtc::I420Buffer> scaled;
+    {
+        MutexAutoLock scaleLock(target.scaleLock);
+        scaled = target.scalePool.CreateBuffer(m_tileWidth, m_tileHeight);
+        if (!scaled)
+            return;
+        libyuv::I420Scale(src->DataY(), src->StrideY(),
+                          src->DataU(), src->StrideU(),
+                          src->DataV(), src->StrideV(),
+                          src->width(), src->height(),
+                          scaled->MutableDataY(), scaled->StrideY(),
+                          scaled->MutableDataU(), scaled->StrideU(),
+                          scaled->MutableDataV(), scaled->StrideV(),
+                          m_tileWidth, m_tileHeight,
+                          libyuv::kFilterBilinear);
+    }
+
+    {
+        MutexAutoLock lock(m_lock);
+        // The tile may have left the cell meanwhile.
+        if (target.sessionId != sessionId)
+            return;
+        target.frame = std::move(scaled);
+        m_dirty = true;
+    }
+    emitFrame(false);
+}
+
+void ScreencastCompositor::finish(std::function<void()>&& callback)
+{
+    {
+        MutexAutoLock lock(m_lock);
+        double endMs = elapsedMs();
+        for (LayoutEntry& entry : m_layout) {
+            if (entry.endMs < 0)
+                entry.endMs = endMs;
+        }
+    }
+    // Tiles that arrived since the last frame would be lost otherwise.
+    emitFrame(true);
+    nsCString layout;
+    {
+        MutexAutoLock emitLock(m_emitLock);
+        MutexAutoLock lock(m_lock);
+        m_finished = true;
+        layout = layoutJSON();
+    }
+
+    if (m_layoutPath.IsEmpty()) {
+        m_encoder->addTag(nsDependentCString(kLayoutTag), layout);
+    } else {
+        m_ioPool->Dispatch(NS_NewRunnableFunction("ScreencastCompositor::finish", [path = m_layoutPath, layout = std::move(layout)] {
+            FILE* file = fopen(path.get(), "w");
+            if (!file) {
+                fprintf(stderr, "ScreencastCompositor failed to create %s\n", path.get());
+                return;
+            }
+            bool written = fputs(layout.get(), file) >= 0;
+            if (fclose(file) || !written)
+                fprintf(stderr, "ScreencastCompositor failed to write %s\n", path.get());
+        }), NS_DISPATCH_NORMAL);
+    }
+    m_encoder->finish(std::move(callback));
+}
+
+// Hands the current tiles to the encoder, at most once per frame interval.
+// Tiles that arrive in between are picked up by the next frame.
+void ScreencastCompositor::emitFrame(bool force)
+{
+    // Frames reach the encoder in the order their tiles were picked.
+    MutexAutoLock emitLock(m_emitLock);
+    std::vector<rtc::scoped_refptr<webrtc::I420Buffer>> frames;
+    TimeStamp now = TimeStamp::Now();
+    {
+        MutexAutoLock lock(m_lock);
+        if (m_finished || !m_dirty)
+            return;
+        if (!force && !m_lastFrameTime.IsNull() && now - m_lastFrameTime < m_frameInterval)
+            return;
+        frames.reserve(m_columns * m_rows);
+        for (int cell = 0; cell < m_columns * m_rows; ++cell)
+            frames.push_back(m_cells[cell].frame);
+        m_lastFrameTime = now;
+        m_dirty = false;
+    }
+
+    // The scaled tiles are not written to once published, so they can be
+    // composed without holding m_lock. The encoder keeps the buffer until it
+    // is encoded.
+    rtc::scoped_refptr<webrtc::I420Buffer> buffer = m_bufferPool.CreateBuffer(m_columns * m_tileWidth, m_rows * m_tileHeight);
+    if (!buffer)
+        return;
+    composeInto(buffer.get(), frames);
+    int64_t timestampUs = static_cast<int64_t>((now - m_startTime).ToMicroseconds());
+    m_encoder->encodeFrame(webrtc::VideoFrame(buffer, webrtc::kVideoRotation_0, timestampUs));
+}
+
+void ScreencastCompositor::composeInto(webrtc::I420Buffer* buffer, const std::vector<rtc::scoped_refptr<webrtc::I420Buffer>>& frames)
+{
+    for (int cell = 0; cell < m_columns * m_rows; ++cell) {
+        const int x = (cell % m_columns) * m_tileWidth;
+        const int y = (cell / m_columns) * m_tileHeight;
+        // Cells start at even coordinates, so the chroma offsets are exact.
+        uint8_t* dstY = buffer->MutableDataY() + y * buffer->StrideY() + x;
+        uint8_t* dstU = buffer->MutableDataU() + y / 2 * buffer->StrideU() + x / 2;
+        uint8_t* dstV = buffer->MutableDataV() + y / 2 * buffer->StrideV() + x / 2;
+        if (const rtc::scoped_refptr<webrtc::I420Buffer>& frame = frames[cell]) {
+            libyuv::I420Copy(frame->DataY(), frame->StrideY(),
+                             frame->DataU(), frame->StrideU(),
+                             frame->DataV(), frame->StrideV(),
+                             dstY, buffer->StrideY(),
+                             dstU, buffer->StrideU(),
+                             dstV, buffer->StrideV(),
+                             m_tileWidth, m_tileHeight);
+            continue;
+        }
+        // Black in limited-range YUV.
+        libyuv::SetPlane(dstY, buffer->StrideY(), m_tileWidth, m_tileHeight, 16);
+        libyuv::SetPlane(dstU, buffer->StrideU(), m_tileWidth / 2, m_tileHeight / 2, 128);
+        libyuv::SetPlane(dstV, buffer->StrideV(), m_tileWidth / 2, m_tileHeight / 2, 128);
+    }
+}
+
+double ScreencastCompositor::elapsedMs() const
+{
+    return (TimeStamp::Now() - m_startTime).ToMilliseconds();
+}
+
+// Maps the cells of the video to the sessions shown in them, e.g.
+// [{"sessionId": 3, "x": 0, "y": 0, "width": 640, "height": 360,
+//   "start": 0.0, "end": 5000.0}]. Times are in milliseconds since the
+// start of the recording.
+nsCString ScreencastCompositor::layoutJSON()
+{
+    nsCString json;
+    json.Append('[');
+    for (size_t i = 0; i < m_layout.size(); ++i) {
+        const LayoutEntry& entry = m_layout[i];
+        json.AppendPrintf("%s{\"sessionId\": %d, \"x\": %d, \"y\": %d, \"width\": %d, \"height\": %d, \"start\": %.1f, \"end\": %.1f}",
+                          i ? ",\n " : "", entry.sessionId,
+                          (entry.cell % m_columns) * m_tileWidth, (entry.cell / m_columns) * m_tileHeight,
+                          m_tileWidth, m_tileHeight, entry.startMs, entry.endMs);
+    }
+    json.Append("]\n");
+    return json;
+}
+
+} // namespace mozilla
@@ -0,0 +1,105 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include "mozilla/Mutex.h"
+#include "mozilla/RefPtr.h"
+#include "mozilla/TimeStamp.h"
+#include "nsCOMPtr.h"
+#include "nsISupportsImpl.h"
+#include "nsString.h"
+#include "webrtc/api/video/i420_buffer.h"
+#include "webrtc/common_video/include/i420_buffer_pool.h"
+
+class nsIEventTarget;
+
+namespace webrtc {
+class VideoFrame;
+}
+
+namespace mozilla {
+
+class ScreencastEncoder;
+
+// Tiles the frames of several captures into the cells of a grid recorded by
+// a single encoder. Tiles are fed from their capturers' threads and scaled
+// there, frames reach the encoder one at a time.
+class ScreencastCompositor {
+    NS_INLINE_DECL_THREADSAFE_REFCOUNTING(ScreencastCompositor)
+public:
+    // |encoder| must record frames of |columns| * |tileWidth| x |rows| *
+    // |tileHeight|. On finish(), the tile layout is written to |layoutPath|
+    // on |ioPool|, or into the container as the kLayoutTag tag when the path
+    // is empty.
+    ScreencastCompositor(RefPtr<ScreencastEncoder>&& encoder, int tileWidth, int tileHeight, int columns, int rows, int maxFPS, const nsCString& layoutPath, nsIEventTarget* ioPool);
+
+    // Returns the cell showing |sessionId|, or -1 if the grid is full.
+    int addTile(int sessionId);
+    void removeTile(int cell);
+    // Scales |frame| into |cell|.
+    void onTileFrame(int cell, const webrtc::VideoFrame& frame);
+
+    void finish(std::function<void()>&& callback);
+
+    ScreencastEncoder* encoder() const { return m_encoder; }
+
+    static const char kLayoutTag[];
+
+private:
+    ~ScreencastCompositor();
+
+    struct LayoutEntry {
+        int sessionId;
+        int cell;
+        double startMs;
+        double endMs;
+    };
+
+    struct Cell {
+        // Serializes the scaling into the cell, which the capturer of the
+        // previous tile may still be doing when a new one takes over the cell.
+        Mutex scaleLock { "ScreencastCompositor::Cell::scaleLock" };
+        // Guarded by scaleLock.
+        webrtc::I420BufferPool scalePool;
+        // Guarded by m_lock. The latest scaled frame, black while null.
+        int sessionId { -1 };
+        rtc::scoped_refptr<webrtc::I420Buffer> frame;
+    };
+
+    void emitFrame(bool force);
+    void composeInto(webrtc::I420Buffer* buffer, const std::vector<rtc::scoped_refptr<webrtc::I420Buffer>>& frames);
+    double elapsedMs() const;
+    nsCString layoutJSON();
+
+    const RefPtr<ScreencastEncoder> m_encoder;
+    const int m_tileWidth;
+    const int m_tileHeight;
+    const int m_columns;
+    const int m_rows;
+    const TimeDuration m_frameInterval;
+    const nsCString m_layoutPath;
+    const nsCOMPtr<nsIEventTarget> m_ioPool;
+    const TimeStamp m_startTime;
+
+    const std::unique_ptr<Cell[]> m_cells;
+
+    Mutex m_lock;
+    // Guarded by m_lock.
+    std::vector<LayoutEntry> m_layout;
+    TimeStamp m_lastFrameTime;
+    bool m_dirty { true };
+    bool m_finished { false };
+
+    // Held while a frame is composed and handed to the encoder, which takes
+    // one frame at a time.
+    Mutex m_emitLock;
+    // Guarded by m_emitLock.
+    webrtc::I420BufferPool m_bufferPool;
+};
+
+} // namespace mozilla
@@ -31,23 +31,35 @@
 
 #include "ScreencastEncoder.h"
 
+#include <algorithm>
+#include <deque>
+#include <vector>
 #include <libyuv.h>
-#include <vpx/vp8.h>
-#include <vpx/vp8cx.h>
-#include <vpx/vpx_encoder.h>
+#include "ScreencastBufferPool.h"
+#include "ScreencastEncoderBackend.h"
+#include "ScreencastMuxer.h"
+#include "ScreencastOutput.h"
+#include "mozilla/Logging.h"
+#include "mozilla/Mutex.h"
+#include "mozilla/ScopeExit.h"
+#include "mozilla/TaskQueue.h"
 #include "nsThreadUtils.h"
 #include "webrtc/api/video/video_frame.h"
 
 namespace mozilla {
 
+// Per-frame tracing, enable with MOZ_LOG=Screencast:5.
+static LazyLogModule gScreencastLog("Screencast");
+
 namespace {
 // Defines the dimension of a macro block. This is used to compute the active
 // map for the encoder.
 const int kMacroBlockSize = 16;
 
-void createImage(unsigned int width, unsigned int height,
+void createImage(ScreencastBufferPool* pool,
+                 unsigned int width, unsigned int height,
                  std::unique_ptr<vpx_image_t>& out_image,
-                 std::unique_ptr<uint8_t[]>& out_image_buffer) {
+                 ScreencastBufferPool::Buffer& out_image_buffer) {
   std::unique_ptr<vpx_image_t> image(new vpx_image_t());
   memset(image.get(), 0, sizeof(vpx_image_t));
 
@@ -79,7 +91,7 @@ void createImage(unsigned int width, unsigned int height,
 
   // Allocate a YUV buffer large enough for the aligned data & padding.
   const int buffer_size = y_stride * y_rows + 2*uv_stride * uv_rows;
-  std::unique_ptr<uint8_t[]> image_buffer(new uint8_t[buffer_size]);
+  ScreencastBufferPool::Buffer image_buffer = pool->acquire(buffer_size);
 
   // Reset image value to 128 so we just need to fill in the y plane.
   memset(image_buffer.get(), 128, buffer_size);
@@ -98,226 +110,466 @@ void createImage(unsigned int width, unsigned int height,
   out_image_buffer = std::move(image_buffer);
 }
 
-void mem_put_le16(void *vmem, int val) {
-  unsigned char *mem = (unsigned char *)vmem;
-
-  mem[0] = (unsigned char)((val >> 0) & 0xff);
-  mem[1] = (unsigned char)((val >> 8) & 0xff);
+// Returns true if libvpx can read the planes of |buffer| in place. This
+// requires the same layout createImage() produces: 16-byte aligned planes and
+// strides, and dimensions that are whole macroblocks so that the encoder
+// never reads past the end of the planes.
+bool canWrapI420Buffer(const webrtc::I420BufferInterface& buffer,
+                       unsigned int width, unsigned int height) {
+  if (static_cast<unsigned int>(buffer.width()) != width ||
+      static_cast<unsigned int>(buffer.height()) != height)
+    return false;
+  if ((width % kMacroBlockSize) != 0 || (height % kMacroBlockSize) != 0)
+    return false;
+  if ((buffer.StrideY() % 16) != 0 || (buffer.StrideU() % 16) != 0 ||
+      (buffer.StrideV() % 16) != 0)
+    return false;
+  auto isAligned = [](const uint8_t* data) {
+    return (reinterpret_cast<uintptr_t>(data) & 15) == 0;
+  };
+  return isAligned(buffer.DataY()) && isAligned(buffer.DataU()) &&
+         isAligned(buffer.DataV());
 }
 
-void mem_put_le32(void *vmem, int val) {
-  unsigned char *mem = (unsigned char *)vmem;
+void wrapI420Buffer(const webrtc::I420BufferInterface& buffer,
+                    vpx_image_t* image) {
+  memset(image, 0, sizeof(vpx_image_t));
 
-  mem[0] = (unsigned char)((val >>  0) & 0xff);
-  mem[1] = (unsigned char)((val >>  8) & 0xff);
-  mem[2] = (unsigned char)((val >> 16) & 0xff);
-  mem[3] = (unsigned char)((val >> 24) & 0xff);
-}
+  image->d_w = buffer.width();
+  image->w = buffer.width();
+  image->d_h = buffer.height();
+  image->h = buffer.height();
 
-void ivf_write_file_header_with_video_info(FILE *outfile, uint32_t fourcc,
-                                           int frame_cnt, int frame_width,
-                                           int frame_height,
-                                           vpx_rational_t timebase) {
-  char header[32];
-
-  header[0] = 'D';
-  header[1] = 'K';
-  header[2] = 'I';
-  header[3] = 'F';
-  mem_put_le16(header + 4, 0);              // version
-  mem_put_le16(header + 6, 32);             // header size
-  mem_put_le32(header + 8, fourcc);         // fourcc
-  mem_put_le16(header + 12, frame_width);   // width
-  mem_put_le16(header + 14, frame_height);  // height
-  mem_put_le32(header + 16, timebase.den);  // rate
-  mem_put_le32(header + 20, timebase.num);  // scale
-  mem_put_le32(header + 24, frame_cnt);     // length
-  mem_put_le32(header + 28, 0);             // unused
-
-  fwrite(header, 1, 32, outfile);
-}
+  image->fmt = VPX_IMG_FMT_YV12;
+  image->x_chroma_shift = 1;
+  image->y_chroma_shift = 1;
 
-void ivf_write_file_header(FILE *outfile, const struct vpx_codec_enc_cfg *cfg,
-                           uint32_t fourcc, int frame_cnt) {
-  ivf_write_file_header_with_video_info(outfile, fourcc, frame_cnt, cfg->g_w,
-                                        cfg->g_h, cfg->g_timebase);
+  // libvpx only reads from the source image.
+  image->planes[0] = const_cast<uint8_t*>(buffer.DataY());
+  image->planes[1] = const_cast<uint8_t*>(buffer.DataU());
+  image->planes[2] = const_cast<uint8_t*>(buffer.DataV());
+  image->stride[0] = buffer.StrideY();
+  image->stride[1] = buffer.StrideU();
+  image->stride[2] = buffer.StrideV();
 }
 
-void ivf_write_frame_header(FILE *outfile, int64_t pts, size_t frame_size) {
-  char header[12];
-
-  mem_put_le32(header, (int)frame_size);
-  mem_put_le32(header + 4, (int)(pts & 0xFFFFFFFF));
-  mem_put_le32(header + 8, (int)(pts >> 32));
-  fwrite(header, 1, 12, outfile);
+// Marks the macroblocks in which |current| differs from |previous| in
+// |activeMap|, a |rows| x |cols| array, and returns true if any did. Rows are
+// compared with memcmp, which is vectorized, and blocks already known to be
+// active are not compared again.
+bool computeActiveMap(const vpx_image_t& previous, const vpx_image_t& current,
+                      unsigned char* activeMap, int rows, int cols) {
+  memset(activeMap, 0, rows * cols);
+  bool changed = false;
+  for (int plane = 0; plane < 3; ++plane) {
+    // Chroma planes are subsampled in both directions.
+    const int shift = plane ? 1 : 0;
+    const int blockSize = kMacroBlockSize >> shift;
+    const int width = (current.d_w + shift) >> shift;
+    const int height = (current.d_h + shift) >> shift;
+    for (int y = 0; y < height; ++y) {
+      unsigned char* mapRow = activeMap + (y / blockSize) * cols;
+      const uint8_t* previousRow = previous.planes[plane] + y * previous.stride[plane];
+      const uint8_t* currentRow = current.planes[plane] + y * current.stride[plane];
+      for (int col = 0; col < cols; ++col) {
+        if (mapRow[col])
+          continue;
+        const int x = col * blockSize;
+        if (memcmp(previousRow + x, currentRow + x, std::min(blockSize, width - x))) {
+          mapRow[col] = 1;
+          changed = true;
+        }
+      }
+    }
+  }
+  return changed;
 }
 
 } // namespace
 
 class ScreencastEncoder::VPXFrame {
 public:
-    VPXFrame(rtc::scoped_refptr<webrtc::VideoFrameBuffer>&& buffer, Maybe<double> scale)
-        : m_frameBuffer(std::move(buffer))
-        , m_scale(scale)
-    { }
+    // Frames are recycled by the pipeline, see Pipeline::acquireFrame().
+    void reset(rtc::scoped_refptr<webrtc::VideoFrameBuffer>&& buffer, TimeStamp captureTime)
+    {
+        m_frameBuffer = std::move(buffer);
+        m_captureTime = captureTime;
+        m_pts = 0;
+        m_duration = 0;
+    }
 
-    void setDuration(int duration) { m_duration = duration; }
+    void setTimestamp(int64_t pts, int duration)
+    {
+        m_pts = pts;
+        m_duration = duration;
+    }
+    int64_t pts() const { return m_pts; }
     int duration() const { return m_duration; }
-
-    void convertToVpxImage(vpx_image_t* image)
+    TimeStamp captureTime() const { return m_captureTime; }
+
+    // Returns the image to pass to the encoder. When the captured planes
+    // already have the output size and satisfy libvpx's padding rules they
+    // are wrapped without copying, otherwise they are copied or scaled into
+    // |paddedImage|. The returned image is valid as long as this frame is
+    // alive.
+    vpx_image_t* convertToVpxImage(vpx_image_t* paddedImage)
     {
         if (m_frameBuffer->type() != webrtc::VideoFrameBuffer::Type::kI420) {
             fprintf(stderr, "convertToVpxImage unexpected frame buffer type: %d\n", m_frameBuffer->type());
-            return;
+            return paddedImage;
         }
 
         auto src = m_frameBuffer->GetI420();
 
-        const int y_stride = image->stride[0];
-        MOZ_ASSERT(image->stride[1] == image->stride[2]);
-        const int uv_stride = image->stride[1];
-        uint8_t* y_data = image->planes[0];
-        uint8_t* u_data = image->planes[1];
-        uint8_t* v_data = image->planes[2];
-
-        libyuv::I420Copy(src->DataY(), src->StrideY(),
-                         src->DataU(), src->StrideU(),
-                         src->DataV(), src->StrideV(),
-                         y_data, y_stride,
-                         u_data, uv_stride,
-                         v_data, uv_stride,
-                         image->w, image->h);
+        // Backends are done with the source once encode() returns, so the
+        // wrapped planes need not outlive the call.
+        if (canWrapI420Buffer(*src, paddedImage->w, paddedImage->h)) {
+            wrapI420Buffer(*src, &m_wrappedImage);
+            return &m_wrappedImage;
+        }
+
+        const int y_stride = paddedImage->stride[0];
+        MOZ_ASSERT(paddedImage->stride[1] == paddedImage->stride[2]);
+        const int uv_stride = paddedImage->stride[1];
+        uint8_t* y_data = paddedImage->planes[0];
+        uint8_t* u_data = paddedImage->planes[1];
+        uint8_t* v_data = paddedImage->planes[2];
+
+        const int width = paddedImage->w;
+        const int height = paddedImage->h;
+        if (src->width() == width && src->height() == height) {
+            libyuv::I420Copy(src->DataY(), src->StrideY(),
+                             src->DataU(), src->StrideU(),
+                             src->DataV(), src->StrideV(),
+                             y_data, y_stride,
+                             u_data, uv_stride,
+                             v_data, uv_stride,
+                             width, height);
+            return paddedImage;
+        }
+
+        // The window was resized or the output is scaled. Bilinear filtering
+        // has SIMD paths for both down- and upscaling.
+        libyuv::I420Scale(src->DataY(), src->StrideY(),
+                          src->DataU(), src->StrideU(),
+                          src->DataV(), src->StrideV(),
+                          src->width(), src->height(),
+                          y_data, y_stride,
+                          u_data, uv_stride,
+                          v_data, uv_stride,
+                          width, height,
+                          libyuv::kFilterBilinear);
+        return paddedImage;
     }
 
 private:
     rtc::scoped_refptr<webrtc::VideoFrameBuffer> m_frameBuffer;
-    Maybe<double> m_scale;
+    TimeStamp m_captureTime;
+    int64_t m_pts = 0;
     int m_duration = 0;
+    vpx_image_t m_wrappedImage;
 };
 
 
-class ScreencastEncoder::VPXCodec {
+// Queues captured frames, converts them and passes them through the
+// encoder backend into the muxer on the session's encoder queue.
+class ScreencastEncoder::Pipeline {
 public:
-    VPXCodec(uint32_t fourcc, vpx_codec_ctx_t codec, vpx_codec_enc_cfg_t cfg, FILE* file)
-        : m_fourcc(fourcc)
-        , m_codec(codec)
-        , m_cfg(cfg)
-        , m_file(file)
+    Pipeline(std::unique_ptr<ScreencastEncoderBackend>&& backend, int width, int height, std::unique_ptr<ScreencastMuxer>&& muxer, size_t maxPendingFrames, unsigned int checkpointInterval, RefPtr<TaskQueue>&& encoderQueue, ScreencastBufferPool* bufferPool)
+        : m_encoderQueue(std::move(encoderQueue))
+        , m_backend(std::move(backend))
+        , m_muxer(std::move(muxer))
+        , m_checkpointInterval(checkpointInterval)
+        , m_activeMapRows((height + kMacroBlockSize - 1) / kMacroBlockSize)
+        , m_activeMapCols((width + kMacroBlockSize - 1) / kMacroBlockSize)
+        , m_activeMap(new unsigned char[m_activeMapRows * m_activeMapCols])
+        , m_maxPendingFrames(std::max<size_t>(1, maxPendingFrames))
+        , m_pendingFramesLock("Pipeline::m_pendingFramesLock")
+    {
+        createImage(bufferPool, width, height, m_image, m_imageBuffer);
+        createImage(bufferPool, width, height, m_spareImage, m_spareImageBuffer);
+    }
+
+    // Destroys the pipeline once the tasks already queued for it have run,
+    // so that the releasing thread does not wait for the encoder to catch up.
+    static void destroyAsync(std::unique_ptr<Pipeline>&& pipeline)
     {
-        nsresult rv = NS_NewNamedThread("Screencast enc", getter_AddRefs(m_encoderQueue));
-        if (rv != NS_OK) {
-          fprintf(stderr, "ScreencastEncoder::VPXCodec failed to spawn thread %d\n", rv);
-          return;
+        RefPtr<TaskQueue> queue = pipeline->m_encoderQueue;
+        queue->Dispatch(NS_NewRunnableFunction("Pipeline::destroyAsync", [pipeline = std::move(pipeline)] {}));
+        queue->BeginShutdown();
+    }
+
+    const char* backendName() const { return m_backend->name(); }
+
+    // Returns a frame for |buffer|, reusing one that was already encoded so
+    // that the steady state allocates no frames.
+    std::unique_ptr<VPXFrame> acquireFrame(rtc::scoped_refptr<webrtc::VideoFrameBuffer>&& buffer, TimeStamp captureTime)
+    {
+        std::unique_ptr<VPXFrame> frame;
+        {
+            MutexAutoLock lock(m_pendingFramesLock);
+            if (!m_freeFrames.empty()) {
+                frame = std::move(m_freeFrames.back());
+                m_freeFrames.pop_back();
+            }
+        }
+        if (!frame)
+            frame = std::make_unique<VPXFrame>();
+        frame->reset(std::move(buffer), captureTime);
+        return frame;
+    }
+
+    void encodeFrameAsync(std::unique_ptr<VPXFrame>&& frame)
+    {
+        {
+            MutexAutoLock lock(m_pendingFramesLock);
+            if (m_pendingFrames.size() >= m_maxPendingFrames) {
+                // The encoder is falling behind. Fold the oldest pending frame
+                // into its successor so that the timeline stays intact while
+                // the queue (and the frame buffers it holds) stays bounded.
+                std::unique_ptr<VPXFrame> dropped = std::move(m_pendingFrames.front());
+                m_pendingFrames.pop_front();
+                VPXFrame* next = m_pendingFrames.empty() ? frame.get() : m_pendingFrames.front().get();
+                next->setTimestamp(dropped->pts(), dropped->duration() + next->duration());
+                ++m_stats.framesDropped;
+                recycleFrameLocked(std::move(dropped));
+            }
+            m_pendingFrames.push_back(std::move(frame));
+            m_stats.maxQueueDepth = std::max(m_stats.maxQueueDepth, m_pendingFrames.size());
+            if (m_drainScheduled)
+                return;
+            m_drainScheduled = true;
         }
+        m_encoderQueue->Dispatch(NS_NewRunnableFunction("Pipeline::encodeFrameAsync", [this] {
+            drainPendingFrames();
+        }));
+    }
 
-        ivf_write_file_header(m_file, &m_cfg, m_fourcc, 0);
+    void onFrameCaptured(bool skipped)
+    {
+        MutexAutoLock lock(m_pendingFramesLock);
+        ++m_stats.framesCaptured;
+        if (skipped)
+            ++m_stats.framesDropped;
+    }
 
-        createImage(cfg.g_w, cfg.g_h, m_image, m_imageBuffer);
+    Stats stats()
+    {
+        MutexAutoLock lock(m_pendingFramesLock);
+        return m_stats;
     }
 
-    ~VPXCodec() {
-      m_encoderQueue->Shutdown();
-      m_encoderQueue = nullptr;
+    Load load()
+    {
+        MutexAutoLock lock(m_pendingFramesLock);
+        return Load { m_pendingFrames.size(), m_lastFrameChanged };
     }
 
-    void encodeFrameAsync(std::unique_ptr<VPXFrame>&& frame)
+    void addTagAsync(const nsCString& name, const nsCString& value)
     {
-        m_encoderQueue->Dispatch(NS_NewRunnableFunction("VPXCodec::encodeFrameAsync", [this, frame = std::move(frame)] {
-            frame->convertToVpxImage(m_image.get());
-            // TODO: figure out why passing duration to the codec results in much
-            // worse visual quality and makes video stutter.
-            for (int i = 0; i < frame->duration(); i++)
-                encodeFrame(m_image.get(), 1);
+        m_encoderQueue->Dispatch(NS_NewRunnableFunction("Pipeline::addTagAsync", [this, name, value] {
+            if (!m_muxer->addTag(name, value))
+                fprintf(stderr, "Failed to add tag %s to screencast output\n", name.get());
         }));
     }
 
     void finishAsync(std::function<void()>&& callback)
     {
-        m_encoderQueue->Dispatch(NS_NewRunnableFunction("VPXCodec::finishAsync", [this, callback = std::move(callback)] {
+        m_encoderQueue->Dispatch(NS_NewRunnableFunction("Pipeline::finishAsync", [this, callback = std::move(callback)] {
             finish();
             callback();
         }));
     }
 
 private:
-    bool encodeFrame(vpx_image_t *img, int duration)
+    void drainPendingFrames()
     {
-        vpx_codec_iter_t iter = nullptr;
-        const vpx_codec_cx_pkt_t *pkt = nullptr;
-        int flags = 0;
-        const vpx_codec_err_t res = vpx_codec_encode(&m_codec, img, m_pts, duration, flags, VPX_DL_REALTIME);
-        if (res != VPX_CODEC_OK) {
-            fprintf(stderr, "Failed to encode frame: %s\n", vpx_codec_error(&m_codec));
-            return false;
+        for (;;) {
+            std::unique_ptr<VPXFrame> frame;
+            {
+                MutexAutoLock lock(m_pendingFramesLock);
+                if (m_pendingFrames.empty()) {
+                    m_drainScheduled = false;
+                    return;
+                }
+                frame = std::move(m_pendingFrames.front());
+                m_pendingFrames.pop_front();
+            }
+            vpx_image_t* image = frame->convertToVpxImage(m_image.get());
+            bool changed = updateActiveMap(image);
+            {
+                MutexAutoLock lock(m_pendingFramesLock);
+                m_lastFrameChanged = changed;
+            }
+            // Each distinct frame is encoded once and covers the whole interval
+            // until the next capture, so static pages cost a single encode.
+            if (encodeFrame(image, frame->pts(), frame->duration())) {
+                MutexAutoLock lock(m_pendingFramesLock);
+                m_stats.captureToEncodeLatency.add(TimeStamp::Now() - frame->captureTime());
+            }
+
+            // Keep the encoded image to diff the next frame against: either
+            // the captured planes it wraps or the padded copy.
+            if (image == m_image.get()) {
+                std::swap(m_image, m_spareImage);
+                std::swap(m_imageBuffer, m_spareImageBuffer);
+            }
+            m_previousImage = image;
+            if (m_previousFrame) {
+                MutexAutoLock lock(m_pendingFramesLock);
+                recycleFrameLocked(std::move(m_previousFrame));
+            }
+            m_previousFrame = std::move(frame);
         }
+    }
 
-        bool gotPkts = false;
-        while ((pkt = vpx_codec_get_cx_data(&m_codec, &iter)) != nullptr) {
-            gotPkts = true;
+    void recycleFrameLocked(std::unique_ptr<VPXFrame>&& frame)
+    {
+        // Release the captured buffer right away so that the capturer can
+        // reuse it too. At most a queue's worth of frames is ever in flight.
+        frame->reset(nullptr, TimeStamp());
+        if (m_freeFrames.size() <= m_maxPendingFrames)
+            m_freeFrames.push_back(std::move(frame));
+    }
 
-            if (pkt->kind == VPX_CODEC_CX_FRAME_PKT) {
-                ivf_write_frame_header(m_file, m_pts, pkt->data.frame.sz);
-                if (fwrite(pkt->data.frame.buf, 1, pkt->data.frame.sz, m_file) != pkt->data.frame.sz) {
-                    fprintf(stderr, "Failed to write compressed frame\n");
-                    return 0;
-                }
-                bool keyframe = (pkt->data.frame.flags & VPX_FRAME_IS_KEY) != 0;
-                ++m_frameCount;
-                fprintf(stderr, "  #%03d %spts=%" PRId64 " sz=%zd\n", m_frameCount, keyframe ? "[K] " : "", pkt->data.frame.pts, pkt->data.frame.sz);
-                m_pts += pkt->data.frame.duration;
-            }
+    // Lets the backend skip the macroblocks that did not change since the
+    // previous frame. Returns false if none did.
+    bool updateActiveMap(vpx_image_t* image)
+    {
+        if (!m_previousImage) {
+            m_backend->setActiveMap(nullptr, m_activeMapRows, m_activeMapCols);
+            return true;
         }
+        bool changed = computeActiveMap(*m_previousImage, *image, m_activeMap.get(), m_activeMapRows, m_activeMapCols);
+        m_backend->setActiveMap(m_activeMap.get(), m_activeMapRows, m_activeMapCols);
+        return changed;
+    }
 
+    bool encodeFrame(vpx_image_t *img, int64_t pts, int duration)
+    {
+        uint64_t framesEncoded = 0;
+        uint64_t bytesWritten = 0;
+        // The backend hands the packets over from within encode(), keep the
+        // muxer out of the encode time.
+        TimeDuration writeTime;
+        TimeStamp encodeStart = TimeStamp::Now();
+        bool gotPkts = m_backend->encode(img, pts, duration, [&](const ScreencastEncoderBackend::Packet& packet) {
+            TimeStamp writeStart = TimeStamp::Now();
+            auto addWriteTime = MakeScopeExit([&] {
+                writeTime += TimeStamp::Now() - writeStart;
+            });
+            if (!m_muxer->writeFrame(packet.data, packet.size, packet.pts, packet.duration, packet.keyframe)) {
+                fprintf(stderr, "Failed to write compressed frame\n");
+                return false;
+            }
+            ++m_frameCount;
+            ++framesEncoded;
+            bytesWritten += packet.size;
+            MOZ_LOG(gScreencastLog, LogLevel::Verbose, ("  #%03d %spts=%" PRId64 " sz=%zd", m_frameCount, packet.keyframe ? "[K] " : "", packet.pts, packet.size));
+            m_pts = packet.pts + packet.duration;
+            // Keep the file usable should the browser die before finish().
+            // This only patches a few header bytes and hands the buffered
+            // data to the OS.
+            if (m_checkpointInterval && ++m_framesSinceCheckpoint >= m_checkpointInterval) {
+                m_framesSinceCheckpoint = 0;
+                if (!m_muxer->checkpoint())
+                    fprintf(stderr, "Failed to checkpoint screencast output\n");
+            }
+            return true;
+        });
+        TimeDuration encodeTime = TimeStamp::Now() - encodeStart - writeTime;
+
+        {
+            MutexAutoLock lock(m_pendingFramesLock);
+            if (img)
+                m_stats.encodeTime.add(encodeTime);
+            if (framesEncoded)
+                m_stats.writeTime.add(writeTime);
+            m_stats.framesEncoded += framesEncoded;
+            m_stats.bytesWritten += bytesWritten;
+        }
         return gotPkts;
     }
 
     void finish()
     {
         // Flush encoder.
-        while (encodeFrame(nullptr, 1))
+        while (encodeFrame(nullptr, m_pts, 1))
             ++m_frameCount;
 
-        rewind(m_file);
-        // Update total frame count.
-        ivf_write_file_header(m_file, &m_cfg, m_fourcc, m_frameCount);
-        fclose(m_file);
-        fprintf(stderr, "ScreencastEncoder::finish %d frames\n", m_frameCount);
+        if (!m_muxer->finish())
+            fprintf(stderr, "ScreencastEncoder::finish failed to write output\n");
+        Stats stats = this->stats();
+        fprintf(stderr, "ScreencastEncoder::finish %" PRIu64 " frames, %" PRIu64 " dropped, %" PRIu64 " bytes\n", stats.framesEncoded, stats.framesDropped, stats.bytesWritten);
     }
 
-    RefPtr<nsIThread> m_encoderQueue;
-    uint32_t m_fourcc { 0 };
-    vpx_codec_ctx_t m_codec;
-    vpx_codec_enc_cfg_t m_cfg;
-    FILE* m_file { nullptr };
+    RefPtr<TaskQueue> m_encoderQueue;
+    std::unique_ptr<ScreencastEncoderBackend> m_backend;
+    std::unique_ptr<ScreencastMuxer> m_muxer;
     int m_frameCount { 0 };
     int64_t m_pts { 0 };
-    std::unique_ptr<uint8_t[]> m_imageBuffer;
+    const unsigned int m_checkpointInterval;
+    unsigned int m_framesSinceCheckpoint { 0 };
+    ScreencastBufferPool::Buffer m_imageBuffer;
     std::unique_ptr<vpx_image_t> m_image;
+    ScreencastBufferPool::Buffer m_spareImageBuffer;
+    std::unique_ptr<vpx_image_t> m_spareImage;
+
+    // The last encoded frame and the image passed to the encoder for it.
+    std::unique_ptr<VPXFrame> m_previousFrame;
+    vpx_image_t* m_previousImage { nullptr };
+    const unsigned int m_activeMapRows;
+    const unsigned int m_activeMapCols;
+    std::unique_ptr<unsigned char[]> m_activeMap;
+
+    const size_t m_maxPendingFrames;
+    Mutex m_pendingFramesLock;
+    // Guarded by m_pendingFramesLock.
+    std::deque<std::unique_ptr<VPXFrame>> m_pendingFrames;
+    std::vector<std::unique_ptr<VPXFrame>> m_freeFrames;
+    bool m_drainScheduled { false };
+    bool m_lastFrameChanged { true };
+    Stats m_stats;
 };
 
-ScreencastEncoder::ScreencastEncoder(std::unique_ptr<VPXCodec>&& vpxCodec, int width, int height, Maybe<double> scale)
-    : m_vpxCodec(std::move(vpxCodec))
+ScreencastEncoder::ScreencastEncoder(std::unique_ptr<Pipeline>&& pipeline, int width, int height, Maybe<double> scale)
+    : m_pipeline(std::move(pipeline))
     , m_width(width)
     , m_height(height)
     , m_scale(scale)
 {
 }
 
+void ScreencastEncoder::Histogram::add(TimeDuration sample)
+{
+    size_t bucket = 0;
+    double ms = sample.ToMilliseconds();
+    while (bucket + 1 < kBucketCount && ms >= bucketUpperBoundMs(bucket))
+        ++bucket;
+    ++counts[bucket];
+}
+
 ScreencastEncoder::~ScreencastEncoder()
 {
+    if (m_pipeline)
+        Pipeline::destroyAsync(std::move(m_pipeline));
 }
 
-static constexpr uint32_t vp8fourcc = 0x30385056;
-static constexpr uint32_t vp9fourcc = 0x30395056;
-static constexpr int fps = 30;
+// Frames are timestamped with their capture time, so use a millisecond
+// timebase rather than a fixed frame rate.
+static constexpr int timeScale = 1000;
 
-RefPtr<ScreencastEncoder> ScreencastEncoder::create(nsCString& errorString, const nsCString& filePath, int width, int height, Maybe<double> scale)
+RefPtr<ScreencastEncoder> ScreencastEncoder::create(nsCString& errorString, std::unique_ptr<ScreencastOutput>&& output, int width, int height, Maybe<double> scale, const Options& options, nsIEventTarget* encoderPool, ScreencastBufferPool* bufferPool)
 {
-    const uint32_t fourcc = vp8fourcc;
-    vpx_codec_iface_t* codec_interface = vpx_codec_vp8_cx();
-    if (!codec_interface) {
-        errorString = "Codec not found.";
-        return nullptr;
+    if (scale) {
+        if (*scale <= 0) {
+            errorString.AppendPrintf("Invalid scale: %f", *scale);
+            return nullptr;
+        }
+        // Frames are downscaled to the output size on the encoder thread,
+        // I420 requires the result to be even.
+        width = static_cast<int>(width * *scale) & ~1;
+        height = static_cast<int>(height * *scale) & ~1;
     }
 
     if (width <= 0 || height <= 0 || (width % 2) != 0 || (height % 2) != 0) {
@@ -325,70 +577,95 @@ RefPtr<ScreencastEncoder> ScreencastEncoder::create(nsCString& errorString, cons
         return nullptr;
     }
 
-    vpx_codec_enc_cfg_t cfg;
-    memset(&cfg, 0, sizeof(cfg));
-    vpx_codec_err_t error = vpx_codec_enc_config_default(codec_interface, &cfg, 0);
-    if (error) {
-        errorString.AppendPrintf("Failed to get default codec config: %s", vpx_codec_err_to_string(error));
+    std::unique_ptr<ScreencastEncoderBackend> backend = ScreencastEncoderBackend::createVPX(errorString, options, width, height, timeScale);
+    if (!backend)
         return nullptr;
-    }
-
-    cfg.g_w = width;
-    cfg.g_h = height;
-    cfg.g_timebase.num = 1;
-    cfg.g_timebase.den = fps;
-    cfg.g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT;
 
-    vpx_codec_ctx_t codec;
-    if (vpx_codec_enc_init(&codec, codec_interface, &cfg, 0)) {
-        errorString.AppendPrintf("Failed to initialize encoder: %s", vpx_codec_error(&codec));
+    ScreencastMuxer::VideoInfo info { backend->fourcc(), width, height, 1, timeScale };
+    std::unique_ptr<ScreencastMuxer> muxer = options.container == Container::WebM
+        ? ScreencastMuxer::createWebM(std::move(output), info)
+        : ScreencastMuxer::createIVF(std::move(output), info);
+    if (!muxer) {
+        errorString = "Failed to write container header.";
         return nullptr;
     }
 
-    FILE* file = fopen(filePath.get(), "wb");
-    if (!file) {
-        errorString.AppendPrintf("Failed to open file '%s' for writing: %s", filePath.get(), strerror(errno));
-        return nullptr;
-    }
-
-    std::unique_ptr<VPXCodec> vpxCodec(new VPXCodec(fourcc, codec, cfg, file));
-    fprintf(stderr, "ScreencastEncoder initialized with: %s\n", vpx_codec_iface_name(codec_interface));
-    return new ScreencastEncoder(std::move(vpxCodec), width, height, scale);
+    // Sessions share the pool threads, the task queue keeps this session's
+    // frames in order.
+    RefPtr<TaskQueue> encoderQueue = new TaskQueue(do_AddRef(encoderPool), "ScreencastEncoder");
+    std::unique_ptr<Pipeline> pipeline(new Pipeline(std::move(backend), width, height, std::move(muxer), options.maxPendingFrames, options.checkpointInterval, std::move(encoderQueue), bufferPool));
+    return new ScreencastEncoder(std::move(pipeline), width, height, scale);
 }
 
-void ScreencastEncoder::flushLastFrame()
+void ScreencastEncoder::flushLastFrame(int64_t endTimeUs)
 {
-    TimeStamp now = TimeStamp::Now();
-    if (m_lastFrameTimestamp) {
-        // If previous frame encoding failed for some rason leave the timestampt intact.
-        if (!m_lastFrame)
-            return;
-
-        TimeDuration seconds = now - m_lastFrameTimestamp;
-        int duration = 1 + seconds.ToSeconds() * fps; // Duration in timebase units
-        m_lastFrame->setDuration(duration);
-        m_vpxCodec->encodeFrameAsync(std::move(m_lastFrame));
-    }
-    m_lastFrameTimestamp = now;
+    // If previous frame encoding failed for some reason leave the timestamps intact.
+    if (!m_lastFrame)
+        return;
+
+    int64_t endPts = (endTimeUs - m_firstFrameTimeUs) * timeScale / 1000000;
+    // Keep pts strictly increasing even if capture timestamps are not.
+    int duration = std::max<int64_t>(1, endPts - m_nextFramePts);
+    m_lastFrame->setTimestamp(m_nextFramePts, duration);
+    m_nextFramePts += duration;
+    m_pipeline->encodeFrameAsync(std::move(m_lastFrame));
 }
 
 void ScreencastEncoder::encodeFrame(const webrtc::VideoFrame& videoFrame)
 {
-    fprintf(stderr, "ScreencastEncoder::encodeFrame\n");
-    flushLastFrame();
+    MOZ_LOG(gScreencastLog, LogLevel::Verbose, ("ScreencastEncoder::encodeFrame"));
+    int64_t timeUs = videoFrame.timestamp_us();
+    if (m_lastFrame)
+        flushLastFrame(timeUs);
+    else if (m_firstFrameTimeUs < 0)
+        m_firstFrameTimeUs = timeUs;
+
+    m_lastFrameTimeUs = timeUs;
+    m_lastFrameTimestamp = TimeStamp::Now();
+    m_lastFrame = m_pipeline->acquireFrame(videoFrame.video_frame_buffer(), m_lastFrameTimestamp);
+    m_pipeline->onFrameCaptured(false);
+}
 
-    m_lastFrame = std::make_unique<VPXFrame>(videoFrame.video_frame_buffer(), m_scale);
+void ScreencastEncoder::skipFrame()
+{
+    m_pipeline->onFrameCaptured(true);
+}
+
+const char* ScreencastEncoder::backendName() const
+{
+    return m_pipeline ? m_pipeline->backendName() : "";
+}
+
+ScreencastEncoder::Stats ScreencastEncoder::stats() const
+{
+    return m_pipeline ? m_pipeline->stats() : Stats();
+}
+
+ScreencastEncoder::Load ScreencastEncoder::load() const
+{
+    return m_pipeline ? m_pipeline->load() : Load();
+}
+
+void ScreencastEncoder::addTag(const nsCString& name, const nsCString& value)
+{
+    if (m_pipeline)
+        m_pipeline->addTagAsync(name, value);
 }
 
 void ScreencastEncoder::finish(std::function<void()>&& callback)
 {
-    if (!m_vpxCodec) {
+    if (!m_pipeline) {
         callback();
         return;
     }
 
-    flushLastFrame();
-    m_vpxCodec->finishAsync([callback = std::move(callback)] () mutable {
+    if (m_lastFrame) {
+        // The last frame lasts until now. Translate the wall clock into the
+        // capture clock domain using the frame's arrival time.
+        TimeDuration elapsed = TimeStamp::Now() - m_lastFrameTimestamp;
+        flushLastFrame(m_lastFrameTimeUs + static_cast<int64_t>(elapsed.ToMicroseconds()));
+    }
+    m_pipeline->finishAsync([callback = std::move(callback)] () mutable {
         NS_DispatchToMainThread(NS_NewRunnableFunction("ScreencastEncoder::finish callback", std::move(callback)));
     });
 }
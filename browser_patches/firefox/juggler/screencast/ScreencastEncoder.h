@@ -15,30 +15,111 @@ namespace webrtc {
 class VideoFrame;
 }
 
+class nsIEventTarget;
+
 namespace mozilla {
 
+class ScreencastBufferPool;
+class ScreencastOutput;
+class TaskQueue;
+
 class ScreencastEncoder {
     NS_INLINE_DECL_THREADSAFE_REFCOUNTING(ScreencastEncoder)
 public:
+    enum class Codec { VP8, VP9 };
+    enum class Container { IVF, WebM };
+
+    // Zero values keep the libvpx defaults.
+    struct Options {
+        Codec codec = Codec::VP8;
+        Container container = Container::IVF;
+        unsigned int bitrateKbps = 0;
+        int cpuUsed = 0;
+        unsigned int threads = 0;
+        unsigned int tokenPartitions = 0;
+        unsigned int keyframeInterval = 0;
+        // Bounds the number of frames waiting for the encoder thread. Once
+        // reached, the oldest pending frame is coalesced into the next one
+        // and counted as dropped.
+        size_t maxPendingFrames = 4;
+        // Number of encoded frames between container checkpoints, see
+        // ScreencastMuxer::checkpoint().
+        unsigned int checkpointInterval = 30;
+    };
+
+    // Power-of-two millisecond buckets: bucket 0 counts samples below 1ms,
+    // bucket i samples in [2^(i-1), 2^i) ms and the last one all above.
+    struct Histogram {
+        static constexpr size_t kBucketCount = 12;
+        static double bucketUpperBoundMs(size_t bucket) { return static_cast<double>(1 << bucket); }
+
+        void add(TimeDuration sample);
 
-    static RefPtr<ScreencastEncoder> create(nsCString& errorString, const nsCString& filePath, int width, int height, Maybe<double> scale);
+        uint32_t counts[kBucketCount] = {};
+    };
 
-    class VPXCodec;
-    ScreencastEncoder(std::unique_ptr<VPXCodec>&&, int width, int height, Maybe<double> scale);
+    struct Stats {
+        uint64_t framesCaptured = 0;
+        uint64_t framesEncoded = 0;
+        // Captured frames that were coalesced into the next one, either
+        // because the encoder fell behind or because they were skipped.
+        uint64_t framesDropped = 0;
+        // High-water mark of frames waiting for the encoder.
+        size_t maxQueueDepth = 0;
+        // Encoded frame data passed to the muxer, without container overhead.
+        uint64_t bytesWritten = 0;
+        // From the frame's arrival to the end of its encode.
+        Histogram captureToEncodeLatency;
+        // Time spent in the backend's encode call per frame, without the
+        // muxer writes it makes.
+        Histogram encodeTime;
+        // Time spent in the muxer per encoded frame, checkpoints included.
+        Histogram writeTime;
+    };
+
+    // Captured frames are scaled to |width| x |height| times |scale|. Frames
+    // are encoded in order on a serial queue running on |encoderPool|, the
+    // conversion buffers come from |bufferPool|.
+    static RefPtr<ScreencastEncoder> create(nsCString& errorString, std::unique_ptr<ScreencastOutput>&& output, int width, int height, Maybe<double> scale, const Options& options, nsIEventTarget* encoderPool, ScreencastBufferPool* bufferPool);
+
+    class Pipeline;
+    ScreencastEncoder(std::unique_ptr<Pipeline>&&, int width, int height, Maybe<double> scale);
 
     void encodeFrame(const webrtc::VideoFrame& videoFrame);
+    // Counts a captured frame that is not passed to encodeFrame, the previous
+    // frame lasts longer instead.
+    void skipFrame();
+
+    struct Load {
+        // Frames waiting for the encoder.
+        size_t pendingFrames = 0;
+        // Whether the last encoded frame differed from the one before it.
+        bool changed = true;
+    };
+
+    // Can be called on any thread.
+    Stats stats() const;
+    Load load() const;
+    // Name of the encoder in use, e.g. "libvpx".
+    const char* backendName() const;
 
+    // Stores |value| under |name| in the container, if it has tags. Must be
+    // called before finish().
+    void addTag(const nsCString& name, const nsCString& value);
     void finish(std::function<void()>&& callback);
 
 private:
     ~ScreencastEncoder();
 
-    void flushLastFrame();
+    void flushLastFrame(int64_t endTimeUs);
 
-    std::unique_ptr<VPXCodec> m_vpxCodec;
+    std::unique_ptr<Pipeline> m_pipeline;
     int m_width;
     int m_height;
     Maybe<double> m_scale;
+    int64_t m_firstFrameTimeUs { -1 };
+    int64_t m_lastFrameTimeUs { 0 };
+    int64_t m_nextFramePts { 0 };
     TimeStamp m_lastFrameTimestamp;
     class VPXFrame;
     std::unique_ptr<VPXFrame> m_lastFrame;
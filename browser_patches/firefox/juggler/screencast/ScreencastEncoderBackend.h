@@ -0,0 +1,49 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vpx/vpx_image.h>
+#include "ScreencastEncoder.h"
+
+namespace mozilla {
+
+// Compresses the I420 images of a recording. All methods apart from the
+// factory are called on the session's encoder queue.
+class ScreencastEncoderBackend {
+public:
+    struct Packet {
+        const void* data;
+        size_t size;
+        int64_t pts;
+        int64_t duration;
+        bool keyframe;
+    };
+    using PacketCallback = std::function<bool(const Packet&)>;
+
+    virtual ~ScreencastEncoderBackend() = default;
+
+    // Reported in the recording stats, e.g. "libvpx".
+    virtual const char* name() const = 0;
+    // Identifies the bitstream in the container.
+    virtual uint32_t fourcc() const = 0;
+
+    // |map| has one byte per macroblock, non-zero for the blocks that changed
+    // since the previous image. A null map marks all blocks as changed.
+    // Backends that cannot skip blocks ignore it.
+    virtual void setActiveMap(const unsigned char* map, unsigned int rows, unsigned int cols) { }
+
+    // Encodes |image|, or drains delayed frames when it is null, and passes
+    // the compressed frames to |onPacket|. |image| is not used after the call
+    // returns. Returns true if any frame was produced.
+    virtual bool encode(vpx_image_t* image, int64_t pts, int duration, const PacketCallback& onPacket) = 0;
+
+    // Frames are |width| x |height| with timestamps in 1 / |timebaseDen|
+    // seconds.
+    static std::unique_ptr<ScreencastEncoderBackend> createVPX(nsCString& errorString, const ScreencastEncoder::Options& options, int width, int height, int timebaseDen);
+};
+
+} // namespace mozilla
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2010, The WebM Project authors. All rights reserved.
+ * Copyright (C) 2020 Microsoft Corporation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ScreencastMuxer.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "ScreencastOutput.h"
+#include "nsString.h"
+
+namespace mozilla {
+
+namespace {
+
+void mem_put_le16(void *vmem, int val) {
+  unsigned char *mem = (unsigned char *)vmem;
+
+  mem[0] = (unsigned char)((val >> 0) & 0xff);
+  mem[1] = (unsigned char)((val >> 8) & 0xff);
+}
+
+void mem_put_le32(void *vmem, int val) {
+  unsigned char *mem = (unsigned char *)vmem;
+
+  mem[0] = (unsigned char)((val >>  0) & 0xff);
+  mem[1] = (unsigned char)((val >>  8) & 0xff);
+  mem[2] = (unsigned char)((val >> 16) & 0xff);
+  mem[3] = (unsigned char)((val >> 24) & 0xff);
+}
+
+const size_t kIvfFileHeaderSize = 32;
+const size_t kIvfFrameHeaderSize = 12;
+
+void ivf_file_header_with_video_info(char (&header)[kIvfFileHeaderSize],
+                                     uint32_t fourcc, int frame_cnt,
+                                     int frame_width, int frame_height,
+                                     int timebase_num, int timebase_den) {
+  header[0] = 'D';
+  header[1] = 'K';
+  header[2] = 'I';
+  header[3] = 'F';
+  mem_put_le16(header + 4, 0);              // version
+  mem_put_le16(header + 6, 32);             // header size
+  mem_put_le32(header + 8, fourcc);         // fourcc
+  mem_put_le16(header + 12, frame_width);   // width
+  mem_put_le16(header + 14, frame_height);  // height
+  mem_put_le32(header + 16, timebase_den);  // rate
+  mem_put_le32(header + 20, timebase_num);  // scale
+  mem_put_le32(header + 24, frame_cnt);     // length
+  mem_put_le32(header + 28, 0);             // unused
+}
+
+int mem_get_le32(const void *vmem) {
+  const unsigned char *mem = (const unsigned char *)vmem;
+
+  return (int)(((unsigned)mem[3] << 24) | (mem[2] << 16) | (mem[1] << 8) | mem[0]);
+}
+
+void ivf_frame_header(char (&header)[kIvfFrameHeaderSize], int64_t pts,
+                      size_t frame_size) {
+  mem_put_le32(header, (int)frame_size);
+  mem_put_le32(header + 4, (int)(pts & 0xFFFFFFFF));
+  mem_put_le32(header + 8, (int)(pts >> 32));
+}
+
+class IVFMuxer final : public ScreencastMuxer {
+public:
+    IVFMuxer(std::unique_ptr<ScreencastOutput>&& output, const VideoInfo& info)
+        : m_output(std::move(output))
+        , m_info(info)
+    { }
+
+    bool writeHeader()
+    {
+        return writeFileHeader(false);
+    }
+
+    bool writeFrame(const void* data, size_t size, int64_t pts, int64_t duration, bool keyframe) override
+    {
+        char header[kIvfFrameHeaderSize];
+        ivf_frame_header(header, pts, size);
+        if (!m_output->write(header, kIvfFrameHeaderSize) || !m_output->write(data, size))
+            return false;
+        ++m_frameCount;
+        return m_output->commit();
+    }
+
+    bool checkpoint() override
+    {
+        bool result = writeFileHeader(true);
+        return m_output->flush() && result;
+    }
+
+    bool finish() override
+    {
+        // Update total frame count.
+        bool result = writeFileHeader(true);
+        return m_output->close() && result;
+    }
+
+private:
+    bool writeFileHeader(bool update)
+    {
+        char header[kIvfFileHeaderSize];
+        ivf_file_header_with_video_info(header, m_info.fourcc, m_frameCount,
+                                        m_info.width, m_info.height,
+                                        m_info.timebaseNum, m_info.timebaseDen);
+        if (update)
+            return m_output->writeAt(0, header, kIvfFileHeaderSize);
+        return m_output->write(header, kIvfFileHeaderSize);
+    }
+
+    std::unique_ptr<ScreencastOutput> m_output;
+    VideoInfo m_info;
+    int m_frameCount { 0 };
+};
+
+} // namespace
+
+std::unique_ptr<ScreencastMuxer> ScreencastMuxer::createIVF(std::unique_ptr<ScreencastOutput>&& output, const VideoInfo& info)
+{
+    auto muxer = std::make_unique<IVFMuxer>(std::move(output), info);
+    if (!muxer->writeHeader())
+        return nullptr;
+    return muxer;
+}
+
+bool ScreencastMuxer::recover(nsCString& errorString, const nsCString& filePath, uint64_t& frameCount)
+{
+    FILE* file = fopen(filePath.get(), "r+b");
+    if (!file) {
+        errorString.AppendPrintf("Failed to open file '%s': %s", filePath.get(), strerror(errno));
+        return false;
+    }
+    unsigned char magic[4];
+    uint64_t fileSize = 0;
+    uint64_t validSize = 0;
+    bool result = false;
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || ScreencastOutput::seekFile(file, 0, SEEK_END)) {
+        errorString = "The file has no header.";
+    } else {
+        fileSize = ScreencastOutput::tellFile(file);
+        if (!memcmp(magic, "DKIF", 4))
+            result = recoverIVF(errorString, file, fileSize, frameCount, validSize);
+        else if (magic[0] == 0x1A && magic[1] == 0x45 && magic[2] == 0xDF && magic[3] == 0xA3)
+            result = recoverWebM(errorString, file, fileSize, frameCount, validSize);
+        else
+            errorString = "The file is neither IVF nor WebM.";
+    }
+    if (fclose(file) && result) {
+        errorString.AppendPrintf("Failed to write '%s': %s", filePath.get(), strerror(errno));
+        return false;
+    }
+    if (!result) {
+        errorString.Insert(nsPrintfCString("Cannot recover '%s': ", filePath.get()), 0);
+        return false;
+    }
+    // Drop the partial frame.
+    if (validSize < fileSize)
+        return ScreencastOutput::truncateFile(errorString, filePath, validSize);
+    return true;
+}
+
+bool ScreencastMuxer::recoverIVF(nsCString& errorString, FILE* file, uint64_t fileSize, uint64_t& frameCount, uint64_t& validSize)
+{
+    if (fileSize < kIvfFileHeaderSize) {
+        errorString = "The file has no header.";
+        return false;
+    }
+
+    // Walk the frame headers up to the first frame that does not fit.
+    uint64_t end = kIvfFileHeaderSize;
+    frameCount = 0;
+    while (end + kIvfFrameHeaderSize <= fileSize) {
+        char header[kIvfFrameHeaderSize];
+        if (ScreencastOutput::seekFile(file, end, SEEK_SET) || fread(header, 1, kIvfFrameHeaderSize, file) != kIvfFrameHeaderSize)
+            break;
+        uint64_t frameEnd = end + kIvfFrameHeaderSize + static_cast<uint32_t>(mem_get_le32(header));
+        if (frameEnd > fileSize)
+            break;
+        end = frameEnd;
+        ++frameCount;
+    }
+
+    char count[4];
+    mem_put_le32(count, static_cast<int>(frameCount));
+    if (ScreencastOutput::seekFile(file, 24, SEEK_SET) || fwrite(count, 1, sizeof(count), file) != sizeof(count)) {
+        errorString.AppendPrintf("Failed to update the header: %s", strerror(errno));
+        return false;
+    }
+    validSize = end;
+    return true;
+}
+
+} // namespace mozilla
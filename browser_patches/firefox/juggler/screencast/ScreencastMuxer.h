@@ -0,0 +1,57 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <memory>
+#include <stdio.h>
+#include "nsStringFwd.h"
+
+namespace mozilla {
+
+class ScreencastOutput;
+
+// Wraps encoded frames into a container and writes them to a
+// ScreencastOutput. All methods are called on the encoder thread, apart from
+// the factories which also write the container header.
+class ScreencastMuxer {
+public:
+    struct VideoInfo {
+        uint32_t fourcc;
+        int width;
+        int height;
+        // Frame timestamps are in units of timebaseNum / timebaseDen seconds.
+        int timebaseNum;
+        int timebaseDen;
+    };
+
+    virtual ~ScreencastMuxer() = default;
+
+    virtual bool writeFrame(const void* data, size_t size, int64_t pts, int64_t duration, bool keyframe) = 0;
+    // Patches the header to cover the frames written so far and flushes the
+    // output, so that the file stays playable up to this point if the
+    // process dies before finish(). Cheap enough to run every few frames.
+    virtual bool checkpoint() = 0;
+    // Adds a tag for the whole file, written by finish(). Returns false if
+    // the container has no tags.
+    virtual bool addTag(const nsCString& name, const nsCString& value) { return false; }
+    // Writes the trailer, patches the header and closes the output.
+    virtual bool finish() = 0;
+
+    static std::unique_ptr<ScreencastMuxer> createIVF(std::unique_ptr<ScreencastOutput>&& output, const VideoInfo& info);
+    static std::unique_ptr<ScreencastMuxer> createWebM(std::unique_ptr<ScreencastOutput>&& output, const VideoInfo& info);
+
+    // Repairs a file whose recording never finished: drops the partially
+    // written frame at its end and fixes the header, so that it plays up to
+    // the last complete frame. Returns the number of frames kept in
+    // |frameCount|.
+    static bool recover(nsCString& errorString, const nsCString& filePath, uint64_t& frameCount);
+
+private:
+    // Return the size of the file's valid prefix in |validSize|.
+    static bool recoverIVF(nsCString& errorString, FILE* file, uint64_t fileSize, uint64_t& frameCount, uint64_t& validSize);
+    static bool recoverWebM(nsCString& errorString, FILE* file, uint64_t fileSize, uint64_t& frameCount, uint64_t& validSize);
+};
+
+} // namespace mozilla
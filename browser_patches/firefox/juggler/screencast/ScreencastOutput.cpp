@@ -0,0 +1,459 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ScreencastOutput.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#ifdef XP_LINUX
+#include <fcntl.h>
+#include <linux/falloc.h>
+#endif
+#ifdef XP_UNIX
+#include <unistd.h>
+#endif
+#ifdef XP_WIN
+#include <fcntl.h>
+#include <io.h>
+#include <share.h>
+#include <sys/stat.h>
+#endif
+#include "mozilla/Monitor.h"
+#include "mozilla/TaskQueue.h"
+#include "nsString.h"
+#include "nsThreadUtils.h"
+
+namespace mozilla {
+
+namespace {
+
+// O_DIRECT requires the buffer address, the file offset and the size of each
+// write to be multiples of the logical block size.
+const size_t kDirectIOAlignment = 4096;
+// Data handed to an async output that has not reached the wrapped output
+// yet. The encoder waits once this is exceeded rather than piling up frames
+// in memory when the disk cannot keep up.
+const size_t kMaxAsyncPendingBytes = 32 << 20;
+
+class FileOutput final : public ScreencastOutput {
+public:
+    FileOutput(FILE* file, size_t bufferSize, bool directIO)
+        : m_file(file)
+        , m_directIO(directIO)
+    {
+        // Data is only ever written from our own buffer, stdio buffering would
+        // just add a copy.
+        setvbuf(m_file, nullptr, _IONBF, 0);
+
+        m_bufferCapacity = std::max<size_t>(bufferSize, kDirectIOAlignment);
+        if (m_directIO)
+            m_bufferCapacity = (m_bufferCapacity + kDirectIOAlignment - 1) & ~(kDirectIOAlignment - 1);
+        m_storage.reset(new uint8_t[m_bufferCapacity + kDirectIOAlignment]);
+        uintptr_t address = reinterpret_cast<uintptr_t>(m_storage.get());
+        m_buffer = reinterpret_cast<uint8_t*>((address + kDirectIOAlignment - 1) & ~(kDirectIOAlignment - 1));
+    }
+
+    ~FileOutput() override
+    {
+        close();
+    }
+
+    bool write(const void* data, size_t size) override
+    {
+        if (!m_file)
+            return false;
+
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        while (size) {
+            size_t chunk = std::min(size, m_bufferCapacity - m_bufferSize);
+            memcpy(m_buffer + m_bufferSize, bytes, chunk);
+            m_bufferSize += chunk;
+            bytes += chunk;
+            size -= chunk;
+            if (m_bufferSize == m_bufferCapacity && !flushBuffer())
+                return false;
+        }
+        return true;
+    }
+
+    bool writeAt(uint64_t offset, const void* data, size_t size) override
+    {
+        if (!m_file || offset + size > m_flushedSize + m_bufferSize)
+            return false;
+
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        // Patch whatever is still in the buffer in place.
+        if (offset + size > m_flushedSize) {
+            size_t skip = offset < m_flushedSize ? m_flushedSize - offset : 0;
+            memcpy(m_buffer + (offset + skip - m_flushedSize), bytes + skip, size - skip);
+            size = skip;
+        }
+        if (!size)
+            return true;
+
+        // The rest is already on disk. The patch is neither aligned nor a
+        // whole block, so temporarily leave direct mode for it.
+        setDirectIO(false);
+        bool result = seekFile(m_file, offset, SEEK_SET) == 0 &&
+                      fwrite(bytes, 1, size, m_file) == size &&
+                      seekFile(m_file, 0, SEEK_END) == 0;
+        setDirectIO(m_directIO);
+        return result;
+    }
+
+    bool flush() override
+    {
+        if (!m_file)
+            return false;
+        if (!m_directIO)
+            return flushBuffer();
+
+        // Only whole blocks can be written directly, the rest stays buffered
+        // until the next flush.
+        size_t size = m_bufferSize & ~(kDirectIOAlignment - 1);
+        if (!size)
+            return true;
+        if (!writeToFile(m_buffer, size)) {
+            fprintf(stderr, "ScreencastOutput failed to write %zu bytes: %s\n", size, strerror(errno));
+            return false;
+        }
+        m_flushedSize += size;
+        m_bufferSize -= size;
+        memmove(m_buffer, m_buffer + size, m_bufferSize);
+        return true;
+    }
+
+    bool close() override
+    {
+        if (!m_file)
+            return true;
+
+        // The tail of the stream is not block aligned.
+        setDirectIO(false);
+        m_directIO = false;
+        bool result = flushBuffer();
+        result = fclose(m_file) == 0 && result;
+        m_file = nullptr;
+        return result;
+    }
+
+private:
+    bool flushBuffer()
+    {
+        if (!m_bufferSize)
+            return true;
+        if (!writeToFile(m_buffer, m_bufferSize)) {
+            fprintf(stderr, "ScreencastOutput failed to write %zu bytes: %s\n", m_bufferSize, strerror(errno));
+            return false;
+        }
+        m_flushedSize += m_bufferSize;
+        m_bufferSize = 0;
+        return true;
+    }
+
+    bool writeToFile(const uint8_t* data, size_t size)
+    {
+#ifdef XP_LINUX
+        if (m_directIO) {
+            while (size) {
+                ssize_t written = ::write(fileno(m_file), data, size);
+                if (written < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return false;
+                }
+                data += written;
+                size -= written;
+            }
+            return true;
+        }
+#endif
+        return fwrite(data, 1, size, m_file) == size;
+    }
+
+    void setDirectIO(bool enabled)
+    {
+#ifdef XP_LINUX
+        if (!m_directIO)
+            return;
+        int fd = fileno(m_file);
+        int flags = fcntl(fd, F_GETFL);
+        if (flags != -1)
+            fcntl(fd, F_SETFL, enabled ? (flags | O_DIRECT) : (flags & ~O_DIRECT));
+#endif
+    }
+
+    FILE* m_file;
+    bool m_directIO;
+    std::unique_ptr<uint8_t[]> m_storage;
+    uint8_t* m_buffer { nullptr };
+    size_t m_bufferCapacity { 0 };
+    size_t m_bufferSize { 0 };
+    uint64_t m_flushedSize { 0 };
+};
+
+class TeeOutput final : public ScreencastOutput {
+public:
+    TeeOutput(std::unique_ptr<ScreencastOutput>&& first, std::unique_ptr<ScreencastOutput>&& second)
+        : m_first(std::move(first))
+        , m_second(std::move(second))
+    { }
+
+    bool write(const void* data, size_t size) override
+    {
+        bool first = m_first->write(data, size);
+        return m_second->write(data, size) && first;
+    }
+
+    bool writeAt(uint64_t offset, const void* data, size_t size) override
+    {
+        bool first = m_first->writeAt(offset, data, size);
+        return m_second->writeAt(offset, data, size) && first;
+    }
+
+    bool commit() override
+    {
+        bool first = m_first->commit();
+        return m_second->commit() && first;
+    }
+
+    bool flush() override
+    {
+        bool first = m_first->flush();
+        return m_second->flush() && first;
+    }
+
+    bool close() override
+    {
+        bool first = m_first->close();
+        return m_second->close() && first;
+    }
+
+private:
+    std::unique_ptr<ScreencastOutput> m_first;
+    std::unique_ptr<ScreencastOutput> m_second;
+};
+
+class AsyncOutput final : public ScreencastOutput {
+public:
+    AsyncOutput(std::unique_ptr<ScreencastOutput>&& output, nsIEventTarget* ioPool)
+        : m_output(std::move(output))
+        , m_ioQueue(new TaskQueue(do_AddRef(ioPool), "ScreencastIO"))
+        , m_monitor("AsyncOutput::m_monitor")
+    { }
+
+    ~AsyncOutput() override
+    {
+        close();
+    }
+
+    bool write(const void* data, size_t size) override
+    {
+        if (m_closed)
+            return false;
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        m_pending.insert(m_pending.end(), bytes, bytes + size);
+        return true;
+    }
+
+    bool writeAt(uint64_t offset, const void* data, size_t size) override
+    {
+        if (m_closed)
+            return false;
+        // The patch may cover data that is still pending.
+        sendPending();
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        std::vector<uint8_t> patch(bytes, bytes + size);
+        dispatch(size, [this, offset, patch = std::move(patch)] {
+            return m_output->writeAt(offset, patch.data(), patch.size());
+        });
+        return !failed();
+    }
+
+    bool commit() override
+    {
+        if (m_closed)
+            return false;
+        sendPending();
+        MonitorAutoLock lock(m_monitor);
+        while (m_pendingBytes > kMaxAsyncPendingBytes)
+            lock.Wait();
+        return !m_failed;
+    }
+
+    bool flush() override
+    {
+        if (m_closed)
+            return false;
+        sendPending();
+        dispatch(0, [this] {
+            return m_output->flush();
+        });
+        return !failed();
+    }
+
+    bool close() override
+    {
+        if (m_closed)
+            return !failed();
+        m_closed = true;
+        sendPending();
+        dispatch(0, [this] {
+            return m_output->close();
+        });
+        {
+            MonitorAutoLock lock(m_monitor);
+            while (m_pendingTasks)
+                lock.Wait();
+        }
+        m_ioQueue->BeginShutdown();
+        return !failed();
+    }
+
+private:
+    void sendPending()
+    {
+        if (m_pending.empty())
+            return;
+        size_t size = m_pending.size();
+        dispatch(size, [this, data = std::move(m_pending)] {
+            return m_output->write(data.data(), data.size()) && m_output->commit();
+        });
+        m_pending.clear();
+    }
+
+    // Tasks capture |this|, which stays alive until close() has seen all of
+    // them run.
+    template<typename Task>
+    void dispatch(size_t size, Task&& task)
+    {
+        {
+            MonitorAutoLock lock(m_monitor);
+            ++m_pendingTasks;
+            m_pendingBytes += size;
+        }
+        nsresult rv = m_ioQueue->Dispatch(NS_NewRunnableFunction("AsyncOutput::dispatch", [this, size, task = std::move(task)] {
+            bool result = task();
+            done(size, result);
+        }));
+        if (NS_FAILED(rv))
+            done(size, false);
+    }
+
+    void done(size_t size, bool result)
+    {
+        MonitorAutoLock lock(m_monitor);
+        m_failed = m_failed || !result;
+        --m_pendingTasks;
+        m_pendingBytes -= size;
+        lock.NotifyAll();
+    }
+
+    bool failed()
+    {
+        MonitorAutoLock lock(m_monitor);
+        return m_failed;
+    }
+
+    std::unique_ptr<ScreencastOutput> m_output;
+    RefPtr<TaskQueue> m_ioQueue;
+    // Written on the encoder thread only.
+    std::vector<uint8_t> m_pending;
+    bool m_closed { false };
+
+    Monitor m_monitor;
+    size_t m_pendingTasks { 0 };
+    size_t m_pendingBytes { 0 };
+    bool m_failed { false };
+};
+
+} // namespace
+
+std::unique_ptr<ScreencastOutput> ScreencastOutput::createTee(std::unique_ptr<ScreencastOutput>&& first, std::unique_ptr<ScreencastOutput>&& second)
+{
+    return std::make_unique<TeeOutput>(std::move(first), std::move(second));
+}
+
+std::unique_ptr<ScreencastOutput> ScreencastOutput::createAsync(std::unique_ptr<ScreencastOutput>&& output, nsIEventTarget* ioPool)
+{
+    return std::make_unique<AsyncOutput>(std::move(output), ioPool);
+}
+
+int ScreencastOutput::seekFile(FILE* file, uint64_t offset, int origin)
+{
+#ifdef XP_WIN
+    return _fseeki64(file, static_cast<__int64>(offset), origin);
+#else
+    return fseeko(file, static_cast<off_t>(offset), origin);
+#endif
+}
+
+uint64_t ScreencastOutput::tellFile(FILE* file)
+{
+#ifdef XP_WIN
+    return static_cast<uint64_t>(_ftelli64(file));
+#else
+    return static_cast<uint64_t>(ftello(file));
+#endif
+}
+
+bool ScreencastOutput::truncateFile(nsCString& errorString, const nsCString& filePath, uint64_t size)
+{
+#ifdef XP_WIN
+    int fd = -1;
+    if (_sopen_s(&fd, filePath.get(), _O_RDWR | _O_BINARY, _SH_DENYNO, _S_IREAD | _S_IWRITE) == 0) {
+        bool result = _chsize_s(fd, static_cast<__int64>(size)) == 0;
+        _close(fd);
+        if (result)
+            return true;
+    }
+#else
+    if (truncate(filePath.get(), static_cast<off_t>(size)) == 0)
+        return true;
+#endif
+    errorString.AppendPrintf("Failed to truncate '%s': %s", filePath.get(), strerror(errno));
+    return false;
+}
+
+std::unique_ptr<ScreencastOutput> ScreencastOutput::createFile(nsCString& errorString, const nsCString& filePath, const FileOptions& options)
+{
+    FILE* file = nullptr;
+    bool directIO = false;
+#ifdef XP_LINUX
+    if (options.directIO) {
+        int fd = open(filePath.get(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        if (fd != -1) {
+            file = fdopen(fd, "wb");
+            if (file)
+                directIO = true;
+            else
+                ::close(fd);
+        } else {
+            // Not all file systems support O_DIRECT, e.g. tmpfs.
+            fprintf(stderr, "ScreencastOutput: O_DIRECT is not available for '%s': %s\n", filePath.get(), strerror(errno));
+        }
+    }
+#endif
+    if (!file)
+        file = fopen(filePath.get(), "wb");
+    if (!file) {
+        errorString.AppendPrintf("Failed to open file '%s' for writing: %s", filePath.get(), strerror(errno));
+        return nullptr;
+    }
+
+#ifdef XP_LINUX
+    // Reserve the space without changing the file size so that a reader never
+    // sees a zero-filled tail.
+    if (options.preallocateSize && fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, 0, options.preallocateSize))
+        fprintf(stderr, "ScreencastOutput: failed to preallocate %" PRIu64 " bytes: %s\n", options.preallocateSize, strerror(errno));
+#endif
+
+    return std::make_unique<FileOutput>(file, options.bufferSize, directIO);
+}
+
+} // namespace mozilla
@@ -0,0 +1,63 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <memory>
+#include <stdio.h>
+#include "nsStringFwd.h"
+
+class nsIEventTarget;
+
+namespace mozilla {
+
+// Destination for the encoded screencast stream. All methods are called on
+// the encoder thread, or on the I/O queue of an output created by
+// createAsync().
+class ScreencastOutput {
+public:
+    virtual ~ScreencastOutput() = default;
+
+    // Appends |size| bytes to the stream.
+    virtual bool write(const void* data, size_t size) = 0;
+    // Overwrites bytes that were previously written, e.g. to patch a
+    // container header once the frame count is known. Targets that hand data
+    // out as it is produced may ignore this.
+    virtual bool writeAt(uint64_t offset, const void* data, size_t size) = 0;
+    // Called once all data of an encoded frame has been written.
+    virtual bool commit() { return true; }
+    // Hands buffered data to the OS so that it survives a crash of the
+    // process. Does not wait for the data to reach the disk.
+    virtual bool flush() { return true; }
+    // Flushes pending data and releases the target.
+    virtual bool close() = 0;
+
+    struct FileOptions {
+        // Size of the write-behind buffer. Data reaches the file in chunks of
+        // this size.
+        size_t bufferSize = 1 << 20;
+        // Disk space to reserve up front, in bytes. Linux only.
+        uint64_t preallocateSize = 0;
+        // Bypass the page cache with O_DIRECT. Linux only.
+        bool directIO = false;
+    };
+
+    static std::unique_ptr<ScreencastOutput> createFile(nsCString& errorString, const nsCString& filePath, const FileOptions& options);
+    // Forwards everything to both outputs.
+    static std::unique_ptr<ScreencastOutput> createTee(std::unique_ptr<ScreencastOutput>&& first, std::unique_ptr<ScreencastOutput>&& second);
+    // Runs all calls to |output| on a serial queue of its own on |ioPool|,
+    // so that flushes and header patches never stall the encoder. Failures
+    // are reported by the call after the one that caused them, close()
+    // waits for the queue and reports all of them.
+    static std::unique_ptr<ScreencastOutput> createAsync(std::unique_ptr<ScreencastOutput>&& output, nsIEventTarget* ioPool);
+
+    // Cuts the file at |filePath| down to |size| bytes.
+    static bool truncateFile(nsCString& errorString, const nsCString& filePath, uint64_t size);
+    // fseek() and ftell() with 64-bit offsets on all platforms, long is 32
+    // bits wide on Windows.
+    static int seekFile(FILE* file, uint64_t offset, int origin);
+    static uint64_t tellFile(FILE* file);
+};
+
+} // namespace mozilla
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2010, The WebM Project authors. All rights reserved.
+ * Copyright (c) 2013 The Chromium Authors. All rights reserved.
+ * Copyright (C) 2020 Microsoft Corporation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ScreencastEncoderBackend.h"
+
+#include <vpx/vp8.h>
+#include <vpx/vp8cx.h>
+#include <vpx/vpx_encoder.h>
+#include "mozilla/Logging.h"
+#include "nsString.h"
+
+namespace mozilla {
+
+static LazyLogModule gScreencastLog("Screencast");
+
+namespace {
+
+constexpr uint32_t vp8fourcc = 0x30385056;
+constexpr uint32_t vp9fourcc = 0x30395056;
+
+class VPXEncoderBackend final : public ScreencastEncoderBackend {
+public:
+    VPXEncoderBackend(vpx_codec_ctx_t codec, uint32_t fourcc)
+        : m_codec(codec)
+        , m_fourcc(fourcc)
+    { }
+
+    ~VPXEncoderBackend() override
+    {
+        vpx_codec_destroy(&m_codec);
+    }
+
+    const char* name() const override { return "libvpx"; }
+    uint32_t fourcc() const override { return m_fourcc; }
+
+    // libvpx does no motion search or residual coding for the inactive
+    // macroblocks. It ignores the map for keyframes.
+    void setActiveMap(const unsigned char* map, unsigned int rows, unsigned int cols) override
+    {
+        vpx_active_map_t activeMap;
+        activeMap.rows = rows;
+        activeMap.cols = cols;
+        activeMap.active_map = const_cast<unsigned char*>(map);
+        if (vpx_codec_control(&m_codec, VP8E_SET_ACTIVEMAP, &activeMap))
+            MOZ_LOG(gScreencastLog, LogLevel::Debug, ("Failed to set active map: %s", vpx_codec_error(&m_codec)));
+    }
+
+    bool encode(vpx_image_t* img, int64_t pts, int duration, const PacketCallback& onPacket) override
+    {
+        vpx_codec_iter_t iter = nullptr;
+        const vpx_codec_cx_pkt_t *pkt = nullptr;
+        int flags = 0;
+        const vpx_codec_err_t res = vpx_codec_encode(&m_codec, img, pts, duration, flags, VPX_DL_REALTIME);
+        if (res != VPX_CODEC_OK) {
+            fprintf(stderr, "Failed to encode frame: %s\n", vpx_codec_error(&m_codec));
+            return false;
+        }
+
+        bool gotPkts = false;
+        while ((pkt = vpx_codec_get_cx_data(&m_codec, &iter)) != nullptr) {
+            gotPkts = true;
+
+            if (pkt->kind == VPX_CODEC_CX_FRAME_PKT) {
+                Packet packet { pkt->data.frame.buf, pkt->data.frame.sz, pkt->data.frame.pts,
+                                static_cast<int64_t>(pkt->data.frame.duration), (pkt->data.frame.flags & VPX_FRAME_IS_KEY) != 0 };
+                if (!onPacket(packet))
+                    return false;
+            }
+        }
+        return gotPkts;
+    }
+
+private:
+    vpx_codec_ctx_t m_codec;
+    const uint32_t m_fourcc;
+};
+
+} // namespace
+
+std::unique_ptr<ScreencastEncoderBackend> ScreencastEncoderBackend::createVPX(nsCString& errorString, const ScreencastEncoder::Options& options, int width, int height, int timebaseDen)
+{
+    const bool isVP9 = options.codec == ScreencastEncoder::Codec::VP9;
+    vpx_codec_iface_t* codec_interface = isVP9 ? vpx_codec_vp9_cx() : vpx_codec_vp8_cx();
+    if (!codec_interface) {
+        errorString = "Codec not found.";
+        return nullptr;
+    }
+
+    vpx_codec_enc_cfg_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    vpx_codec_err_t error = vpx_codec_enc_config_default(codec_interface, &cfg, 0);
+    if (error) {
+        errorString.AppendPrintf("Failed to get default codec config: %s", vpx_codec_err_to_string(error));
+        return nullptr;
+    }
+
+    cfg.g_w = width;
+    cfg.g_h = height;
+    cfg.g_timebase.num = 1;
+    cfg.g_timebase.den = timebaseDen;
+    cfg.g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT;
+    if (options.threads)
+        cfg.g_threads = options.threads;
+    if (options.bitrateKbps)
+        cfg.rc_target_bitrate = options.bitrateKbps;
+    if (options.keyframeInterval) {
+        cfg.kf_mode = VPX_KF_AUTO;
+        cfg.kf_max_dist = options.keyframeInterval;
+    }
+
+    vpx_codec_ctx_t codec;
+    if (vpx_codec_enc_init(&codec, codec_interface, &cfg, 0)) {
+        errorString.AppendPrintf("Failed to initialize encoder: %s", vpx_codec_error(&codec));
+        return nullptr;
+    }
+
+    if (options.cpuUsed && vpx_codec_control(&codec, VP8E_SET_CPUUSED, options.cpuUsed)) {
+        errorString.AppendPrintf("Failed to set cpu-used %d: %s", options.cpuUsed, vpx_codec_error(&codec));
+        vpx_codec_destroy(&codec);
+        return nullptr;
+    }
+
+    if (!isVP9 && options.tokenPartitions) {
+        if (options.tokenPartitions > VP8_EIGHT_TOKENPARTITION ||
+            vpx_codec_control(&codec, VP8E_SET_TOKEN_PARTITIONS, static_cast<int>(options.tokenPartitions))) {
+            errorString.AppendPrintf("Failed to set token partitions %u: %s", options.tokenPartitions, vpx_codec_error(&codec));
+            vpx_codec_destroy(&codec);
+            return nullptr;
+        }
+    }
+
+    fprintf(stderr, "ScreencastEncoder initialized with: %s\n", vpx_codec_iface_name(codec_interface));
+    return std::make_unique<VPXEncoderBackend>(codec, isVP9 ? vp9fourcc : vp8fourcc);
+}
+
+} // namespace mozilla
@@ -0,0 +1,582 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ScreencastMuxer.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <vector>
+#include "ScreencastOutput.h"
+#include "mozilla/Assertions.h"
+#include "nsString.h"
+
+namespace mozilla {
+
+namespace {
+
+// Matroska element IDs, see https://www.matroska.org/technical/elements.html
+const uint32_t kEbml = 0x1A45DFA3;
+const uint32_t kEbmlVersion = 0x4286;
+const uint32_t kEbmlReadVersion = 0x42F7;
+const uint32_t kEbmlMaxIdLength = 0x42F2;
+const uint32_t kEbmlMaxSizeLength = 0x42F3;
+const uint32_t kDocType = 0x4282;
+const uint32_t kDocTypeVersion = 0x4287;
+const uint32_t kDocTypeReadVersion = 0x4285;
+const uint32_t kVoid = 0xEC;
+const uint32_t kSegment = 0x18538067;
+const uint32_t kSeekHead = 0x114D9B74;
+const uint32_t kSeek = 0x4DBB;
+const uint32_t kSeekId = 0x53AB;
+const uint32_t kSeekPosition = 0x53AC;
+const uint32_t kInfo = 0x1549A966;
+const uint32_t kTimecodeScale = 0x2AD7B1;
+const uint32_t kDuration = 0x4489;
+const uint32_t kMuxingApp = 0x4D80;
+const uint32_t kWritingApp = 0x5741;
+const uint32_t kTracks = 0x1654AE6B;
+const uint32_t kTrackEntry = 0xAE;
+const uint32_t kTrackNumber = 0xD7;
+const uint32_t kTrackUid = 0x73C5;
+const uint32_t kTrackType = 0x83;
+const uint32_t kCodecId = 0x86;
+const uint32_t kVideo = 0xE0;
+const uint32_t kPixelWidth = 0xB0;
+const uint32_t kPixelHeight = 0xBA;
+const uint32_t kCluster = 0x1F43B675;
+const uint32_t kTimecode = 0xE7;
+const uint32_t kSimpleBlock = 0xA3;
+const uint32_t kCues = 0x1C53BB6B;
+const uint32_t kCuePoint = 0xBB;
+const uint32_t kCueTime = 0xB3;
+const uint32_t kCueTrackPositions = 0xB7;
+const uint32_t kCueTrack = 0xF7;
+const uint32_t kCueClusterPosition = 0xF1;
+const uint32_t kTags = 0x1254C367;
+const uint32_t kTag = 0x7373;
+const uint32_t kTargets = 0x63C0;
+const uint32_t kSimpleTag = 0x67C8;
+const uint32_t kTagName = 0x45A3;
+const uint32_t kTagString = 0x4487;
+
+const uint32_t kVp9Fourcc = 0x30395056;
+const uint64_t kTrackNumberValue = 1;
+const int kTrackTypeVideo = 1;
+const char kAppName[] = "Playwright Juggler";
+
+// Sizes that are patched at the end are written with the maximum length.
+// For live streams the patches are dropped and the all-ones "unknown size"
+// value stays, which is what Matroska expects there.
+const int kPatchableSizeLength = 8;
+// Space reserved after the segment start for the seek head, which can only
+// be written once the position of the cues is known.
+const size_t kSeekHeadReserve = 96;
+// SimpleBlock timecodes are signed 16-bit offsets from the cluster timecode.
+const int64_t kMaxClusterDurationMs = 30000;
+
+class EbmlBuffer {
+public:
+    const uint8_t* data() const { return m_data.data(); }
+    size_t size() const { return m_data.size(); }
+
+    void writeId(uint32_t id)
+    {
+        int length = id > 0xFFFFFF ? 4 : id > 0xFFFF ? 3 : id > 0xFF ? 2 : 1;
+        writeBigEndian(id, length);
+    }
+
+    void writeSize(uint64_t size)
+    {
+        // All ones is reserved for "unknown".
+        int length = 1;
+        while (length < 8 && size >= (1ULL << (7 * length)) - 1)
+            ++length;
+        writeSize(size, length);
+    }
+
+    void writeSize(uint64_t size, int length)
+    {
+        writeBigEndian(size | (1ULL << (7 * length)), length);
+    }
+
+    void writeUnknownSize()
+    {
+        writeBigEndian(0x01FFFFFFFFFFFFFFULL, kPatchableSizeLength);
+    }
+
+    void writeUInt(uint32_t id, uint64_t value)
+    {
+        int length = 1;
+        while (length < 8 && (value >> (8 * length)))
+            ++length;
+        writeId(id);
+        writeSize(length);
+        writeBigEndian(value, length);
+    }
+
+    void writeFixedUInt(uint32_t id, uint64_t value)
+    {
+        writeId(id);
+        writeSize(8);
+        writeBigEndian(value, 8);
+    }
+
+    void writeFloat(uint32_t id, double value)
+    {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        writeFixedUInt(id, bits);
+    }
+
+    void writeString(uint32_t id, const char* value)
+    {
+        size_t length = strlen(value);
+        writeId(id);
+        writeSize(length);
+        writeBytes(value, length);
+    }
+
+    // Returns the offset of the element's content in this buffer.
+    size_t writeMaster(uint32_t id, const EbmlBuffer& content)
+    {
+        writeId(id);
+        writeSize(content.size());
+        size_t offset = size();
+        writeBytes(content.data(), content.size());
+        return offset;
+    }
+
+    // Fills |totalSize| bytes, which must be at least 2, with a Void element.
+    void writeVoid(size_t totalSize)
+    {
+        writeId(kVoid);
+        if (totalSize - 2 < 127) {
+            writeSize(totalSize - 2, 1);
+            m_data.resize(m_data.size() + totalSize - 2, 0);
+        } else {
+            writeSize(totalSize - 1 - kPatchableSizeLength, kPatchableSizeLength);
+            m_data.resize(m_data.size() + totalSize - 1 - kPatchableSizeLength, 0);
+        }
+    }
+
+    void writeBytes(const void* data, size_t size)
+    {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        m_data.insert(m_data.end(), bytes, bytes + size);
+    }
+
+    void writeBigEndian(uint64_t value, int length)
+    {
+        for (int i = length - 1; i >= 0; --i)
+            m_data.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+
+private:
+    std::vector<uint8_t> m_data;
+};
+
+struct EbmlHeader {
+    uint32_t id;
+    uint64_t size;
+    bool unknownSize;
+    size_t idLength;
+    size_t sizeLength;
+
+    size_t length() const { return idLength + sizeLength; }
+};
+
+// Reads element headers of a file that is being recovered.
+class EbmlReader {
+public:
+    EbmlReader(FILE* file, uint64_t fileSize)
+        : m_file(file)
+        , m_fileSize(fileSize)
+    { }
+
+    // Returns false if the header at |position| is cut off or malformed.
+    bool readHeader(uint64_t position, EbmlHeader& header)
+    {
+        if (position >= m_fileSize)
+            return false;
+        uint8_t bytes[12];
+        size_t available = static_cast<size_t>(std::min<uint64_t>(sizeof(bytes), m_fileSize - position));
+        if (ScreencastOutput::seekFile(m_file, position, SEEK_SET) || fread(bytes, 1, available, m_file) != available)
+            return false;
+
+        header.idLength = vintLength(bytes[0]);
+        if (!header.idLength || header.idLength > 4 || header.idLength >= available)
+            return false;
+        header.id = 0;
+        for (size_t i = 0; i < header.idLength; ++i)
+            header.id = (header.id << 8) | bytes[i];
+
+        header.sizeLength = vintLength(bytes[header.idLength]);
+        if (!header.sizeLength || header.length() > available)
+            return false;
+        uint8_t mask = 0xFF >> header.sizeLength;
+        header.size = bytes[header.idLength] & mask;
+        header.unknownSize = header.size == mask;
+        for (size_t i = header.idLength + 1; i < header.length(); ++i) {
+            header.size = (header.size << 8) | bytes[i];
+            header.unknownSize = header.unknownSize && bytes[i] == 0xFF;
+        }
+        return true;
+    }
+
+    // Marks the size of the element whose size field is at |offset| as
+    // unknown, for elements that are cut short.
+    bool clearSize(uint64_t offset, size_t sizeLength)
+    {
+        uint8_t bytes[8];
+        memset(bytes, 0xFF, sizeof(bytes));
+        bytes[0] = 0xFF >> (sizeLength - 1);
+        return !ScreencastOutput::seekFile(m_file, offset, SEEK_SET) && fwrite(bytes, 1, sizeLength, m_file) == sizeLength;
+    }
+
+private:
+    static size_t vintLength(uint8_t first)
+    {
+        for (size_t i = 0; i < 8; ++i) {
+            if (first & (0x80 >> i))
+                return i + 1;
+        }
+        return 0;
+    }
+
+    FILE* m_file;
+    uint64_t m_fileSize;
+};
+
+// Writes a single video track WebM file. Clusters are written as soon as
+// their frames arrive, with an unknown size that is patched when the next
+// cluster starts, so the output is playable while it is being recorded.
+// A new cluster starts at every keyframe and gets a cue point.
+class WebMMuxer final : public ScreencastMuxer {
+public:
+    WebMMuxer(std::unique_ptr<ScreencastOutput>&& output, const VideoInfo& info)
+        : m_output(std::move(output))
+        , m_info(info)
+    { }
+
+    bool writeHeader()
+    {
+        EbmlBuffer buffer;
+
+        EbmlBuffer ebml;
+        ebml.writeUInt(kEbmlVersion, 1);
+        ebml.writeUInt(kEbmlReadVersion, 1);
+        ebml.writeUInt(kEbmlMaxIdLength, 4);
+        ebml.writeUInt(kEbmlMaxSizeLength, 8);
+        ebml.writeString(kDocType, "webm");
+        // SimpleBlock requires version 2.
+        ebml.writeUInt(kDocTypeVersion, 2);
+        ebml.writeUInt(kDocTypeReadVersion, 2);
+        buffer.writeMaster(kEbml, ebml);
+
+        buffer.writeId(kSegment);
+        buffer.writeUnknownSize();
+        m_segmentDataStart = buffer.size();
+        buffer.writeVoid(kSeekHeadReserve);
+
+        EbmlBuffer info;
+        // Timecodes are in milliseconds.
+        info.writeUInt(kTimecodeScale, 1000000);
+        info.writeString(kMuxingApp, kAppName);
+        info.writeString(kWritingApp, kAppName);
+        size_t durationOffset = info.size();
+        info.writeFloat(kDuration, 0);
+        // Skip the element id and size to get to the value.
+        durationOffset += 3;
+        m_infoPosition = buffer.size() - m_segmentDataStart;
+        m_durationOffset = buffer.writeMaster(kInfo, info) + durationOffset;
+
+        EbmlBuffer video;
+        video.writeUInt(kPixelWidth, m_info.width);
+        video.writeUInt(kPixelHeight, m_info.height);
+        EbmlBuffer track;
+        track.writeUInt(kTrackNumber, kTrackNumberValue);
+        track.writeUInt(kTrackUid, kTrackNumberValue);
+        track.writeUInt(kTrackType, kTrackTypeVideo);
+        track.writeString(kCodecId, m_info.fourcc == kVp9Fourcc ? "V_VP9" : "V_VP8");
+        track.writeMaster(kVideo, video);
+        EbmlBuffer tracks;
+        tracks.writeMaster(kTrackEntry, track);
+        m_tracksPosition = buffer.size() - m_segmentDataStart;
+        buffer.writeMaster(kTracks, tracks);
+
+        return write(buffer);
+    }
+
+    bool writeFrame(const void* data, size_t size, int64_t pts, int64_t duration, bool keyframe) override
+    {
+        int64_t timeMs = toMilliseconds(pts);
+        if (!m_clusterOpen || (keyframe && timeMs > m_clusterTimeMs) ||
+            timeMs - m_clusterTimeMs > kMaxClusterDurationMs) {
+            if (!closeCluster() || !openCluster(timeMs, keyframe))
+                return false;
+        }
+
+        EbmlBuffer block;
+        block.writeId(kSimpleBlock);
+        // Track number, timecode and flags precede the frame.
+        block.writeSize(4 + size);
+        block.writeSize(kTrackNumberValue);
+        block.writeBigEndian(static_cast<uint16_t>(timeMs - m_clusterTimeMs), 2);
+        block.writeBigEndian(keyframe ? 0x80 : 0x00, 1);
+        if (!write(block) || !write(data, size))
+            return false;
+
+        m_endTimeMs = std::max(m_endTimeMs, toMilliseconds(pts + duration));
+        return m_output->commit();
+    }
+
+    // The segment and the open cluster keep their unknown size, which
+    // readers accept.
+    bool checkpoint() override
+    {
+        bool result = patchDuration();
+        return m_output->flush() && result;
+    }
+
+    bool addTag(const nsCString& name, const nsCString& value) override
+    {
+        m_tags.push_back({ name, value });
+        return true;
+    }
+
+    bool finish() override
+    {
+        bool result = closeCluster();
+
+        uint64_t cuesPosition = m_position - m_segmentDataStart;
+        if (!m_cues.empty()) {
+            EbmlBuffer cues;
+            for (const Cue& cue : m_cues) {
+                EbmlBuffer positions;
+                positions.writeUInt(kCueTrack, kTrackNumberValue);
+                positions.writeUInt(kCueClusterPosition, cue.clusterPosition);
+                EbmlBuffer point;
+                point.writeUInt(kCueTime, cue.timeMs);
+                point.writeMaster(kCueTrackPositions, positions);
+                cues.writeMaster(kCuePoint, point);
+            }
+            EbmlBuffer buffer;
+            buffer.writeMaster(kCues, cues);
+            result = write(buffer) && result;
+        }
+
+        uint64_t tagsPosition = m_position - m_segmentDataStart;
+        if (!m_tags.empty()) {
+            // Empty targets apply the tags to the whole segment.
+            EbmlBuffer tag;
+            tag.writeMaster(kTargets, EbmlBuffer());
+            for (const Tag& entry : m_tags) {
+                EbmlBuffer simpleTag;
+                simpleTag.writeString(kTagName, entry.name.get());
+                simpleTag.writeString(kTagString, entry.value.get());
+                tag.writeMaster(kSimpleTag, simpleTag);
+            }
+            EbmlBuffer tags;
+            tags.writeMaster(kTag, tag);
+            EbmlBuffer buffer;
+            buffer.writeMaster(kTags, tags);
+            result = write(buffer) && result;
+        }
+
+        EbmlBuffer seeks;
+        addSeek(seeks, kInfo, m_infoPosition);
+        addSeek(seeks, kTracks, m_tracksPosition);
+        if (!m_cues.empty())
+            addSeek(seeks, kCues, cuesPosition);
+        if (!m_tags.empty())
+            addSeek(seeks, kTags, tagsPosition);
+        EbmlBuffer seekHead;
+        seekHead.writeMaster(kSeekHead, seeks);
+        MOZ_RELEASE_ASSERT(seekHead.size() + 2 <= kSeekHeadReserve);
+        seekHead.writeVoid(kSeekHeadReserve - seekHead.size());
+        result = m_output->writeAt(m_segmentDataStart, seekHead.data(), seekHead.size()) && result;
+        result = patchDuration() && result;
+
+        result = patchSize(m_segmentDataStart - kPatchableSizeLength, m_position - m_segmentDataStart) && result;
+        return m_output->close() && result;
+    }
+
+private:
+    struct Cue {
+        int64_t timeMs;
+        uint64_t clusterPosition;
+    };
+
+    struct Tag {
+        nsCString name;
+        nsCString value;
+    };
+
+    int64_t toMilliseconds(int64_t pts) const
+    {
+        return pts * 1000 * m_info.timebaseNum / m_info.timebaseDen;
+    }
+
+    bool openCluster(int64_t timeMs, bool keyframe)
+    {
+        uint64_t position = m_position;
+        EbmlBuffer cluster;
+        cluster.writeId(kCluster);
+        cluster.writeUnknownSize();
+        m_clusterDataStart = position + cluster.size();
+        cluster.writeUInt(kTimecode, timeMs);
+        if (!write(cluster))
+            return false;
+
+        m_clusterOpen = true;
+        m_clusterTimeMs = timeMs;
+        if (keyframe)
+            m_cues.push_back({ timeMs, position - m_segmentDataStart });
+        return true;
+    }
+
+    bool closeCluster()
+    {
+        if (!m_clusterOpen)
+            return true;
+        m_clusterOpen = false;
+        return patchSize(m_clusterDataStart - kPatchableSizeLength, m_position - m_clusterDataStart);
+    }
+
+    bool patchDuration()
+    {
+        EbmlBuffer duration;
+        double durationMs = static_cast<double>(m_endTimeMs);
+        uint64_t durationBits;
+        memcpy(&durationBits, &durationMs, sizeof(durationBits));
+        duration.writeBigEndian(durationBits, 8);
+        return m_output->writeAt(m_durationOffset, duration.data(), duration.size());
+    }
+
+    bool patchSize(uint64_t offset, uint64_t size)
+    {
+        EbmlBuffer buffer;
+        buffer.writeSize(size, kPatchableSizeLength);
+        return m_output->writeAt(offset, buffer.data(), buffer.size());
+    }
+
+    static void addSeek(EbmlBuffer& seeks, uint32_t id, uint64_t position)
+    {
+        EbmlBuffer seekId;
+        seekId.writeBigEndian(id, 4);
+        EbmlBuffer seek;
+        seek.writeId(kSeekId);
+        seek.writeSize(seekId.size());
+        seek.writeBytes(seekId.data(), seekId.size());
+        seek.writeFixedUInt(kSeekPosition, position);
+        seeks.writeMaster(kSeek, seek);
+    }
+
+    bool write(const EbmlBuffer& buffer)
+    {
+        return write(buffer.data(), buffer.size());
+    }
+
+    bool write(const void* data, size_t size)
+    {
+        if (!m_output->write(data, size))
+            return false;
+        m_position += size;
+        return true;
+    }
+
+    std::unique_ptr<ScreencastOutput> m_output;
+    VideoInfo m_info;
+    uint64_t m_position { 0 };
+    uint64_t m_segmentDataStart { 0 };
+    uint64_t m_infoPosition { 0 };
+    uint64_t m_tracksPosition { 0 };
+    uint64_t m_durationOffset { 0 };
+    bool m_clusterOpen { false };
+    uint64_t m_clusterDataStart { 0 };
+    int64_t m_clusterTimeMs { 0 };
+    int64_t m_endTimeMs { 0 };
+    std::vector<Cue> m_cues;
+    std::vector<Tag> m_tags;
+};
+
+} // namespace
+
+std::unique_ptr<ScreencastMuxer> ScreencastMuxer::createWebM(std::unique_ptr<ScreencastOutput>&& output, const VideoInfo& info)
+{
+    auto muxer = std::make_unique<WebMMuxer>(std::move(output), info);
+    if (!muxer->writeHeader())
+        return nullptr;
+    return muxer;
+}
+
+// Keeps the elements up to the first one that is cut off. Within clusters
+// that is the first incomplete block. Sizes that reach past the cut become
+// unknown. The duration stays at what the last checkpoint wrote.
+bool ScreencastMuxer::recoverWebM(nsCString& errorString, FILE* file, uint64_t fileSize, uint64_t& frameCount, uint64_t& validSize)
+{
+    EbmlReader reader(file, fileSize);
+    EbmlHeader header;
+    if (!reader.readHeader(0, header) || header.length() + header.size > fileSize) {
+        errorString = "The file has no header.";
+        return false;
+    }
+    uint64_t segment = header.length() + header.size;
+    EbmlHeader segmentHeader;
+    if (!reader.readHeader(segment, segmentHeader) || segmentHeader.id != kSegment) {
+        errorString = "The file has no segment.";
+        return false;
+    }
+    uint64_t segmentDataStart = segment + segmentHeader.length();
+    uint64_t end = fileSize;
+    if (!segmentHeader.unknownSize)
+        end = std::min(end, segmentDataStart + segmentHeader.size);
+
+    uint64_t position = segmentDataStart;
+    uint64_t cluster = 0;
+    EbmlHeader clusterHeader;
+    uint64_t clusterEnd = 0;
+    frameCount = 0;
+    validSize = segmentDataStart;
+    while (position < end) {
+        EbmlHeader element;
+        if (!reader.readHeader(position, element))
+            break;
+        // Clusters of unknown size end where the next top level element
+        // starts.
+        if (cluster && (position >= clusterEnd || element.id == kCluster || element.id == kCues))
+            cluster = 0;
+        if (element.id == kCluster) {
+            cluster = position;
+            clusterHeader = element;
+            clusterEnd = element.unknownSize ? end : position + element.length() + element.size;
+            position += element.length();
+            continue;
+        }
+
+        uint64_t elementEnd = position + element.length() + element.size;
+        if (element.unknownSize || elementEnd > end)
+            break;
+        if (cluster && element.id == kSimpleBlock)
+            ++frameCount;
+        position = validSize = elementEnd;
+    }
+
+    // A cluster without any complete child lacks its timecode.
+    if (cluster && validSize <= cluster + clusterHeader.length()) {
+        validSize = cluster;
+        cluster = 0;
+    }
+    bool result = true;
+    if (cluster && !clusterHeader.unknownSize && clusterEnd > validSize)
+        result = reader.clearSize(cluster + clusterHeader.idLength, clusterHeader.sizeLength);
+    if (!segmentHeader.unknownSize && segmentDataStart + segmentHeader.size > validSize)
+        result = reader.clearSize(segment + segmentHeader.idLength, segmentHeader.sizeLength) && result;
+    if (!result)
+        errorString.AppendPrintf("Failed to update element sizes: %s", strerror(errno));
+    return result;
+}
+
+} // namespace mozilla
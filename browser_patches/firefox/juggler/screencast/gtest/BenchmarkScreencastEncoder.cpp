@@ -0,0 +1,207 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Encoder throughput benchmark. It is disabled in regular gtest runs, run it
+// with
+//   GTEST_ALSO_RUN_DISABLED_TESTS=1 ./mach gtest 'ScreencastEncoderBenchmark.*'
+// Prints one line per pattern and resolution so that results can be
+// compared across builds.
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <vector>
+#include "gtest/gtest.h"
+#include "ScreencastBufferPool.h"
+#include "ScreencastEncoder.h"
+#include "ScreencastOutput.h"
+#include "mozilla/Monitor.h"
+#include "mozilla/SharedThreadPool.h"
+#include "mozilla/TimeStamp.h"
+#include "nsString.h"
+#include "nsThreadUtils.h"
+#include "prsystem.h"
+#include "webrtc/api/video/i420_buffer.h"
+#include "webrtc/api/video/video_frame.h"
+
+#ifdef XP_UNIX
+#  include <sys/resource.h>
+#endif
+
+using namespace mozilla;
+
+namespace {
+
+constexpr int kFrameCount = 600;
+// Distinct frames generated ahead of a run and fed to the encoder in turn.
+constexpr int kRingSize = 16;
+constexpr int kFPS = 24;
+
+enum class Pattern { Static, Scrolling, FullMotion };
+
+const char* PatternName(Pattern aPattern) {
+  switch (aPattern) {
+    case Pattern::Static: return "static";
+    case Pattern::Scrolling: return "scrolling";
+    case Pattern::FullMotion: return "full-motion";
+  }
+  return "";
+}
+
+// Discards the encoded stream, counting its size. Each write is signalled on
+// |aMonitor| so that the feeding thread can wait for the encoder to progress.
+class CountingOutput final : public ScreencastOutput {
+ public:
+  CountingOutput(uint64_t* aBytes, Monitor* aMonitor)
+      : mBytes(aBytes), mMonitor(aMonitor) {}
+
+  bool write(const void* data, size_t size) override {
+    MonitorAutoLock lock(*mMonitor);
+    *mBytes += size;
+    lock.Notify();
+    return true;
+  }
+  bool writeAt(uint64_t offset, const void* data, size_t size) override {
+    return true;
+  }
+  bool close() override { return true; }
+
+ private:
+  uint64_t* mBytes;
+  Monitor* mMonitor;
+};
+
+struct CpuUsage {
+  bool available = false;
+  double seconds = 0;
+  // Peak resident size of the whole process so far, not of a single run.
+  long maxRssKb = 0;
+};
+
+CpuUsage GetCpuUsage() {
+  CpuUsage usage;
+#ifdef XP_UNIX
+  struct rusage ru;
+  if (!getrusage(RUSAGE_SELF, &ru)) {
+    usage.available = true;
+    usage.seconds = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+                    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+    // Kilobytes on Linux, bytes on macOS.
+#  ifdef XP_MACOSX
+    usage.maxRssKb = ru.ru_maxrss / 1024;
+#  else
+    usage.maxRssKb = ru.ru_maxrss;
+#  endif
+  }
+#endif
+  return usage;
+}
+
+// A page-like picture: horizontal bands of text-like noise on a light
+// background, so that scrolling moves real detail.
+void FillPage(webrtc::I420Buffer* aBuffer, int aScroll) {
+  for (int y = 0; y < aBuffer->height(); ++y) {
+    uint8_t* row = aBuffer->MutableDataY() + y * aBuffer->StrideY();
+    int line = y + aScroll;
+    bool text = (line / 12) % 3 != 2;
+    for (int x = 0; x < aBuffer->width(); ++x)
+      row[x] = text && ((x * 7 + line * 13) % 11) < 3 ? 30 : 235;
+  }
+  memset(aBuffer->MutableDataU(), 128, aBuffer->StrideU() * aBuffer->ChromaHeight());
+  memset(aBuffer->MutableDataV(), 128, aBuffer->StrideV() * aBuffer->ChromaHeight());
+}
+
+void FillNoise(webrtc::I420Buffer* aBuffer, uint32_t& aSeed) {
+  auto fill = [&aSeed](uint8_t* aData, int aStride, int aWidth, int aHeight) {
+    for (int y = 0; y < aHeight; ++y) {
+      for (int x = 0; x < aWidth; ++x) {
+        aSeed = aSeed * 1664525 + 1013904223;
+        aData[y * aStride + x] = aSeed >> 24;
+      }
+    }
+  };
+  fill(aBuffer->MutableDataY(), aBuffer->StrideY(), aBuffer->width(), aBuffer->height());
+  fill(aBuffer->MutableDataU(), aBuffer->StrideU(), aBuffer->ChromaWidth(), aBuffer->ChromaHeight());
+  fill(aBuffer->MutableDataV(), aBuffer->StrideV(), aBuffer->ChromaWidth(), aBuffer->ChromaHeight());
+}
+
+void RunBenchmark(nsIEventTarget* aPool, ScreencastBufferPool* aBufferPool, Pattern aPattern, int aWidth, int aHeight) {
+  uint64_t bytes = 0;
+  Monitor monitor("ScreencastEncoderBenchmark");
+  ScreencastEncoder::Options options;
+  nsCString error;
+  RefPtr<ScreencastEncoder> encoder = ScreencastEncoder::create(
+      error, std::make_unique<CountingOutput>(&bytes, &monitor), aWidth,
+      aHeight, Nothing(), options, aPool, aBufferPool);
+  ASSERT_TRUE(encoder) << error.get();
+
+  // Frames are generated up front so that only the encoder is measured.
+  uint32_t seed = 1;
+  std::vector<rtc::scoped_refptr<webrtc::I420Buffer>> ring;
+  for (int i = 0; i < (aPattern == Pattern::Static ? 1 : kRingSize); ++i) {
+    rtc::scoped_refptr<webrtc::I420Buffer> buffer = webrtc::I420Buffer::Create(aWidth, aHeight);
+    if (aPattern == Pattern::FullMotion)
+      FillNoise(buffer.get(), seed);
+    else
+      FillPage(buffer.get(), i * 8);
+    ring.push_back(buffer);
+  }
+
+  CpuUsage startUsage = GetCpuUsage();
+  TimeStamp start = TimeStamp::Now();
+  for (int i = 0; i < kFrameCount; ++i) {
+    {
+      // Keep the encoder busy without ever dropping a frame: block until it
+      // has written something whenever the queue is about to overflow. The
+      // timeout covers frames that produce no output.
+      MonitorAutoLock lock(monitor);
+      while (encoder->load().pendingFrames + 1 >= options.maxPendingFrames)
+        lock.Wait(TimeDuration::FromMilliseconds(10));
+    }
+    webrtc::VideoFrame frame(ring[i % ring.size()], webrtc::kVideoRotation_0,
+                             int64_t(i) * 1000000 / kFPS);
+    encoder->encodeFrame(frame);
+  }
+
+  bool finished = false;
+  encoder->finish([&finished] { finished = true; });
+  SpinEventLoopUntil([&finished] { return finished; });
+  TimeDuration elapsed = TimeStamp::Now() - start;
+  CpuUsage endUsage = GetCpuUsage();
+
+  ScreencastEncoder::Stats stats = encoder->stats();
+  double frames = std::max<uint64_t>(1, stats.framesEncoded);
+  nsAutoCString cpu("n/a");
+  nsAutoCString rss("n/a");
+  if (endUsage.available) {
+    cpu.Truncate();
+    cpu.AppendPrintf("%.2f", (endUsage.seconds - startUsage.seconds) * 1000 / frames);
+    rss.Truncate();
+    rss.AppendPrintf("%ld", endUsage.maxRssKb);
+  }
+  printf("ScreencastEncoderBenchmark %s %dx%d [%s]: %.1f fps, %s ms cpu/frame, "
+         "%s KB process peak rss, %" PRIu64 " bytes, %" PRIu64 "/%d frames\n",
+         PatternName(aPattern), aWidth, aHeight, encoder->backendName(),
+         frames / elapsed.ToSeconds(), cpu.get(), rss.get(), bytes,
+         stats.framesEncoded, kFrameCount);
+  EXPECT_EQ(stats.framesDropped, 0u);
+}
+
+}  // namespace
+
+TEST(ScreencastEncoderBenchmark, DISABLED_Patterns)
+{
+  int32_t cores = PR_GetNumberOfProcessors();
+  RefPtr<SharedThreadPool> pool = SharedThreadPool::Get(
+      NS_LITERAL_CSTRING("Screencast bench"), cores > 0 ? cores : 1);
+  RefPtr<ScreencastBufferPool> bufferPool = new ScreencastBufferPool();
+  const struct {
+    int width;
+    int height;
+  } kSizes[] = {{640, 360}, {1280, 720}, {1920, 1080}};
+  for (Pattern pattern : {Pattern::Static, Pattern::Scrolling, Pattern::FullMotion}) {
+    for (const auto& size : kSizes)
+      RunBenchmark(pool, bufferPool, pattern, size.width, size.height);
+  }
+}
@@ -4,21 +4,36 @@
 
 #include "nsScreencastService.h"
 
+#include <algorithm>
+#include <libyuv.h>
+#include "ScreencastBufferPool.h"
+#include "ScreencastCapturer.h"
+#include "ScreencastCompositor.h"
 #include "ScreencastEncoder.h"
+#include "ScreencastMuxer.h"
+#include "ScreencastOutput.h"
+#include "imgIEncoder.h"
+#include "mozilla/Atomics.h"
 #include "mozilla/ClearOnShutdown.h"
+#include "mozilla/Mutex.h"
 #include "mozilla/PresShell.h"
+#include "mozilla/ScopeExit.h"
+#include "mozilla/SharedThreadPool.h"
 #include "mozilla/StaticPtr.h"
+#include "nsComponentManagerUtils.h"
 #include "nsIDocShell.h"
+#include "nsProxyRelease.h"
+#include "nsStreamUtils.h"
 #include "nsThreadManager.h"
 #include "nsView.h"
 #include "nsViewManager.h"
+#include "prsystem.h"
+#include "webrtc/api/video/i420_buffer.h"
 #include "webrtc/modules/desktop_capture/desktop_capturer.h"
 #include "webrtc/modules/desktop_capture/desktop_capture_options.h"
 #include "webrtc/modules/desktop_capture/desktop_device_info.h"
 #include "webrtc/modules/desktop_capture/desktop_frame.h"
 #include "webrtc/modules/video_capture/video_capture.h"
-#include "mozilla/widget/PlatformWidgetTypes.h"
-#include "video_engine/desktop_capture_impl.h"
 
 namespace mozilla {
 
@@ -28,52 +43,410 @@ namespace {
 
 StaticRefPtr<nsScreencastService> gScreencastService;
 
+// Bounds of the adaptive capture rate.
+struct FrameRateOptions {
+  uint32_t minFPS = 4;
+  uint32_t maxFPS = 24;
+};
+
+nsresult ReadEncoderOptions(nsIScreencastEncoderOptions* aOptions, ScreencastEncoder::Options& options, ScreencastOutput::FileOptions& fileOptions, FrameRateOptions& frameRate) {
+  if (!aOptions)
+    return NS_OK;
+
+  nsAutoCString codec;
+  nsresult rv = aOptions->GetCodec(codec);
+  NS_ENSURE_SUCCESS(rv, rv);
+  if (codec.EqualsLiteral("vp9"))
+    options.codec = ScreencastEncoder::Codec::VP9;
+  else if (codec.IsEmpty() || codec.EqualsLiteral("vp8"))
+    options.codec = ScreencastEncoder::Codec::VP8;
+  else
+    return NS_ERROR_INVALID_ARG;
+
+  nsAutoCString container;
+  NS_ENSURE_SUCCESS(rv = aOptions->GetContainer(container), rv);
+  if (container.EqualsLiteral("webm"))
+    options.container = ScreencastEncoder::Container::WebM;
+  else if (container.IsEmpty() || container.EqualsLiteral("ivf"))
+    options.container = ScreencastEncoder::Container::IVF;
+  else
+    return NS_ERROR_INVALID_ARG;
+
+  uint32_t maxPendingFrames = 0;
+  NS_ENSURE_SUCCESS(rv = aOptions->GetBitrate(&options.bitrateKbps), rv);
+  NS_ENSURE_SUCCESS(rv = aOptions->GetCpuUsed(&options.cpuUsed), rv);
+  NS_ENSURE_SUCCESS(rv = aOptions->GetThreads(&options.threads), rv);
+  NS_ENSURE_SUCCESS(rv = aOptions->GetTokenPartitions(&options.tokenPartitions), rv);
+  NS_ENSURE_SUCCESS(rv = aOptions->GetKeyframeInterval(&options.keyframeInterval), rv);
+  NS_ENSURE_SUCCESS(rv = aOptions->GetMaxPendingFrames(&maxPendingFrames), rv);
+  if (maxPendingFrames)
+    options.maxPendingFrames = maxPendingFrames;
+  uint32_t checkpointInterval = 0;
+  NS_ENSURE_SUCCESS(rv = aOptions->GetCheckpointInterval(&checkpointInterval), rv);
+  if (checkpointInterval)
+    options.checkpointInterval = checkpointInterval;
+
+  uint32_t bufferSize = 0;
+  NS_ENSURE_SUCCESS(rv = aOptions->GetOutputBufferSize(&bufferSize), rv);
+  if (bufferSize)
+    fileOptions.bufferSize = bufferSize;
+  NS_ENSURE_SUCCESS(rv = aOptions->GetPreallocateSize(&fileOptions.preallocateSize), rv);
+  NS_ENSURE_SUCCESS(rv = aOptions->GetDirectIO(&fileOptions.directIO), rv);
+
+  uint32_t minFPS = 0;
+  uint32_t maxFPS = 0;
+  NS_ENSURE_SUCCESS(rv = aOptions->GetMinFrameRate(&minFPS), rv);
+  NS_ENSURE_SUCCESS(rv = aOptions->GetMaxFrameRate(&maxFPS), rv);
+  if (maxFPS)
+    frameRate.maxFPS = maxFPS;
+  // A low maximum pulls the default minimum down with it.
+  if (minFPS)
+    frameRate.minFPS = minFPS;
+  else
+    frameRate.minFPS = std::min(frameRate.minFPS, frameRate.maxFPS);
+  if (frameRate.maxFPS > 1000 || frameRate.minFPS > frameRate.maxFPS)
+    return NS_ERROR_INVALID_ARG;
+  return NS_OK;
 }
 
-class nsScreencastService::Session : public rtc::VideoSinkInterface<webrtc::VideoFrame> {
+// Picks the rate at which captured frames are encoded: the maximum while the
+// page changes, decaying towards the minimum while it is idle and backing off
+// quickly when the encoder queue grows. Skipped frames are not lost from the
+// timeline, the previous frame lasts longer instead. Used on the capturer's
+// thread only.
+class FrameRateController {
  public:
-  Session(int sessionId, const nsCString& windowId, RefPtr<ScreencastEncoder>&& encoder)
-      : mSessionId(sessionId)
-      , mCaptureModule(webrtc::DesktopCaptureImpl::Create(
-            sessionId, windowId.get(), webrtc::CaptureDeviceType::Window))
-      , mEncoder(std::move(encoder)) {
+  explicit FrameRateController(const FrameRateOptions& aOptions)
+      : mMinFPS(aOptions.minFPS)
+      , mMaxFPS(aOptions.maxFPS)
+      , mFPS(aOptions.maxFPS) {
   }
 
-  bool Start() {
-    webrtc::VideoCaptureCapability capability;
-    // The size is ignored in fact.
-    capability.width = 1280;
-    capability.height = 960;
-    capability.maxFPS = 24;
-    capability.videoType = webrtc::VideoType::kI420;
-    int error = mCaptureModule->StartCapture(capability);
-    if (error) {
-      fprintf(stderr, "StartCapture error %d\n", error);
+  double FPS() const { return mFPS; }
+
+  // Returns true if the frame captured at |aNow| should be encoded.
+  bool OnFrame(TimeStamp aNow, const ScreencastEncoder::Load& aLoad) {
+    // Tolerate capture jitter, frames of a steady source at the current rate
+    // must not be skipped.
+    if (!mLastFrame.IsNull() && (aNow - mLastFrame).ToSeconds() < 0.8 / mFPS)
       return false;
-    }
+    mLastFrame = aNow;
 
-    mCaptureModule->RegisterCaptureDataCallback(this);
+    if (aLoad.pendingFrames > 1)
+      mFPS = std::max(mMinFPS, mFPS / 2);
+    else if (!aLoad.changed)
+      mFPS = std::max(mMinFPS, mFPS * 0.75);
+    else
+      mFPS = mMaxFPS;
     return true;
   }
 
+ private:
+  const double mMinFPS;
+  const double mMaxFPS;
+  double mFPS;
+  TimeStamp mLastFrame;
+};
+
+// Flow control window shared by a session and its stream output. Chunks are
+// sent on the encoder thread and acknowledged on the main thread.
+class StreamWindow {
+ public:
+  NS_INLINE_DECL_THREADSAFE_REFCOUNTING(StreamWindow)
+
+  explicit StreamWindow(uint32_t size) : mSize(size) {}
+
+  bool IsFull() const { return mSize && mUnacked >= static_cast<int32_t>(mSize); }
+  void OnSent() { ++mUnacked; }
+  void OnAck() {
+    if (--mUnacked < 0)
+      mUnacked = 0;
+  }
+
+ private:
+  ~StreamWindow() = default;
+
+  const uint32_t mSize;
+  Atomic<int32_t> mUnacked { 0 };
+};
+
+// Hands each encoded frame to a nsIScreencastStreamListener on the main thread.
+class StreamOutput final : public ScreencastOutput {
+ public:
+  StreamOutput(nsIScreencastStreamListener* aListener, RefPtr<StreamWindow> aWindow)
+      : mListener(new nsMainThreadPtrHolder<nsIScreencastStreamListener>("StreamOutput::mListener", aListener))
+      , mWindow(std::move(aWindow)) {
+  }
+
+  ~StreamOutput() override {
+    close();
+  }
+
+  bool write(const void* data, size_t size) override {
+    mPending.Append(static_cast<const char*>(data), size);
+    return true;
+  }
+
+  // Chunks that were delivered cannot be patched, consumers get a frame
+  // count of 0 in the IVF header.
+  bool writeAt(uint64_t offset, const void* data, size_t size) override {
+    return true;
+  }
+
+  bool commit() override {
+    if (!mListener || mPending.IsEmpty())
+      return true;
+    mWindow->OnSent();
+    NS_DispatchToMainThread(NS_NewRunnableFunction("StreamOutput::commit", [listener = mListener, data = std::move(mPending)] {
+      listener->OnData(data);
+    }));
+    mPending.Truncate();
+    return true;
+  }
+
+  bool close() override {
+    if (!mListener)
+      return true;
+    commit();
+    NS_DispatchToMainThread(NS_NewRunnableFunction("StreamOutput::close", [listener = mListener] {
+      listener->OnClose();
+    }));
+    mListener = nullptr;
+    return true;
+  }
+
+ private:
+  nsMainThreadPtrHandle<nsIScreencastStreamListener> mListener;
+  RefPtr<StreamWindow> mWindow;
+  nsCString mPending;
+};
+
+class ScreencastStats final : public nsIScreencastStats {
+ public:
+  NS_DECL_ISUPPORTS
+
+  ScreencastStats(const ScreencastEncoder::Stats& stats, const char* encoder)
+      : mStats(stats)
+      , mEncoder(encoder) {
+  }
+
+  NS_IMETHOD GetEncoder(nsACString& aEncoder) override {
+    aEncoder = mEncoder;
+    return NS_OK;
+  }
+
+  NS_IMETHOD GetFramesCaptured(uint64_t* aFramesCaptured) override {
+    *aFramesCaptured = mStats.framesCaptured;
+    return NS_OK;
+  }
+  NS_IMETHOD GetFramesEncoded(uint64_t* aFramesEncoded) override {
+    *aFramesEncoded = mStats.framesEncoded;
+    return NS_OK;
+  }
+  NS_IMETHOD GetFramesDropped(uint64_t* aFramesDropped) override {
+    *aFramesDropped = mStats.framesDropped;
+    return NS_OK;
+  }
+  NS_IMETHOD GetMaxQueueDepth(uint32_t* aMaxQueueDepth) override {
+    *aMaxQueueDepth = mStats.maxQueueDepth;
+    return NS_OK;
+  }
+  NS_IMETHOD GetBytesWritten(uint64_t* aBytesWritten) override {
+    *aBytesWritten = mStats.bytesWritten;
+    return NS_OK;
+  }
+  NS_IMETHOD GetHistogramBounds(nsTArray<double>& aBounds) override {
+    for (size_t i = 0; i + 1 < ScreencastEncoder::Histogram::kBucketCount; ++i)
+      aBounds.AppendElement(ScreencastEncoder::Histogram::bucketUpperBoundMs(i));
+    return NS_OK;
+  }
+  NS_IMETHOD GetCaptureToEncodeLatency(nsTArray<uint32_t>& aCounts) override {
+    aCounts.AppendElements(mStats.captureToEncodeLatency.counts, ScreencastEncoder::Histogram::kBucketCount);
+    return NS_OK;
+  }
+  NS_IMETHOD GetEncodeTime(nsTArray<uint32_t>& aCounts) override {
+    aCounts.AppendElements(mStats.encodeTime.counts, ScreencastEncoder::Histogram::kBucketCount);
+    return NS_OK;
+  }
+  NS_IMETHOD GetWriteTime(nsTArray<uint32_t>& aCounts) override {
+    aCounts.AppendElements(mStats.writeTime.counts, ScreencastEncoder::Histogram::kBucketCount);
+    return NS_OK;
+  }
+
+ private:
+  ~ScreencastStats() = default;
+
+  const ScreencastEncoder::Stats mStats;
+  const nsCString mEncoder;
+};
+
+NS_IMPL_ISUPPORTS(ScreencastStats, nsIScreencastStats)
+
+// Scales |aFrame| to fit into |aMaxWidth| x |aMaxHeight| and encodes it with
+// |aEncoder|. Runs on the encoder pool.
+nsresult EncodeScreenshot(webrtc::VideoFrameBuffer* aFrame, imgIEncoder* aEncoder, const nsAString& aOptions, uint32_t aMaxWidth, uint32_t aMaxHeight, nsACString& aData) {
+  rtc::scoped_refptr<webrtc::I420BufferInterface> frame = aFrame->ToI420();
+  if (!frame)
+    return NS_ERROR_FAILURE;
+
+  double scale = 1;
+  if (aMaxWidth)
+    scale = std::min(scale, static_cast<double>(aMaxWidth) / frame->width());
+  if (aMaxHeight)
+    scale = std::min(scale, static_cast<double>(aMaxHeight) / frame->height());
+  int width = std::max(1, static_cast<int>(frame->width() * scale));
+  int height = std::max(1, static_cast<int>(frame->height() * scale));
+  if (width != frame->width() || height != frame->height()) {
+    // Scale before the conversion, the YUV planes are less than half the
+    // size of the RGB image.
+    rtc::scoped_refptr<webrtc::I420Buffer> scaled = webrtc::I420Buffer::Create(width, height);
+    libyuv::I420Scale(frame->DataY(), frame->StrideY(),
+                      frame->DataU(), frame->StrideU(),
+                      frame->DataV(), frame->StrideV(),
+                      frame->width(), frame->height(),
+                      scaled->MutableDataY(), scaled->StrideY(),
+                      scaled->MutableDataU(), scaled->StrideU(),
+                      scaled->MutableDataV(), scaled->StrideV(),
+                      width, height,
+                      libyuv::kFilterBox);
+    frame = scaled;
+  }
+
+  // libyuv's ARGB is the byte order of INPUT_FORMAT_HOSTARGB on
+  // little-endian hosts.
+  const uint32_t stride = width * 4;
+  std::unique_ptr<uint8_t[]> pixels(new uint8_t[stride * height]);
+  libyuv::I420ToARGB(frame->DataY(), frame->StrideY(),
+                     frame->DataU(), frame->StrideU(),
+                     frame->DataV(), frame->StrideV(),
+                     pixels.get(), stride,
+                     width, height);
+  nsresult rv = aEncoder->InitFromData(pixels.get(), stride * height, width, height, stride, imgIEncoder::INPUT_FORMAT_HOSTARGB, aOptions);
+  NS_ENSURE_SUCCESS(rv, rv);
+  return NS_ConsumeStream(aEncoder, UINT32_MAX, aData);
+}
+
+nsIWidget* GetRootWidget(nsIDocShell* aDocShell) {
+  PresShell* presShell = aDocShell->GetPresShell();
+  if (!presShell)
+    return nullptr;
+  nsViewManager* viewManager = presShell->GetViewManager();
+  if (!viewManager)
+    return nullptr;
+  nsView* view = viewManager->GetRootView();
+  if (!view)
+    return nullptr;
+  return view->GetWidget();
+}
+
+}
+
+class nsScreencastService::Session : public rtc::VideoSinkInterface<webrtc::VideoFrame> {
+ public:
+  Session(std::unique_ptr<ScreencastCapturer>&& capturer, RefPtr<ScreencastEncoder>&& encoder, RefPtr<StreamWindow>&& streamWindow, const FrameRateOptions& frameRate)
+      : mEncoder(std::move(encoder))
+      , mStreamWindow(std::move(streamWindow))
+      , mFrameRate(frameRate)
+      , mLatestFrameLock("Session::mLatestFrameLock")
+      , mCapturer(std::move(capturer)) {
+  }
+
+  bool Start() {
+    return mCapturer->Start(this);
+  }
+
   void Stop() {
-    mCaptureModule->DeRegisterCaptureDataCallback(this);
-    int error = mCaptureModule->StopCapture();
-    if (error) {
-      fprintf(stderr, "StopCapture error %d\n", error);
-      return;
-    }
+    mCapturer->Stop();
+    // Flush the buffered output and patch the container header.
+    mEncoder->finish([] {});
+  }
+
+  void AckStream() {
+    if (mStreamWindow)
+      mStreamWindow->OnAck();
+  }
+
+  ScreencastEncoder* Encoder() const {
+    return mEncoder;
+  }
+
+  // The most recent captured frame, whether it was encoded or skipped.
+  rtc::scoped_refptr<webrtc::VideoFrameBuffer> LatestFrame() {
+    MutexAutoLock lock(mLatestFrameLock);
+    return mLatestFrame;
   }
 
-  // These callbacks end up running on the VideoCapture thread.
+  // Called on the capturer's thread.
   void OnFrame(const webrtc::VideoFrame& videoFrame) override {
+    {
+      MutexAutoLock lock(mLatestFrameLock);
+      mLatestFrame = videoFrame.video_frame_buffer();
+    }
+    // The stream consumer is behind, the previous frame just lasts longer.
+    if (mStreamWindow && mStreamWindow->IsFull()) {
+      mEncoder->skipFrame();
+      return;
+    }
+    double fps = mFrameRate.FPS();
+    if (!mFrameRate.OnFrame(TimeStamp::Now(), mEncoder->load())) {
+      mEncoder->skipFrame();
+      return;
+    }
+    if (mFrameRate.FPS() != fps)
+      mCapturer->SetFrameRate(mFrameRate.FPS());
     mEncoder->encodeFrame(videoFrame);
   }
 
  private:
-  int mSessionId;
-  rtc::scoped_refptr<webrtc::VideoCaptureModule> mCaptureModule;
   RefPtr<ScreencastEncoder> mEncoder;
+  RefPtr<StreamWindow> mStreamWindow;
+  FrameRateController mFrameRate;
+  Mutex mLatestFrameLock;
+  rtc::scoped_refptr<webrtc::VideoFrameBuffer> mLatestFrame;
+  // Declared last so that it stops delivering frames before the rest of the
+  // session is destroyed.
+  std::unique_ptr<ScreencastCapturer> mCapturer;
+};
+
+// One page of a composite recording, drawn into a cell of the compositor's
+// canvas.
+class nsScreencastService::Tile : public rtc::VideoSinkInterface<webrtc::VideoFrame> {
+ public:
+  Tile(std::unique_ptr<ScreencastCapturer>&& capturer, RefPtr<ScreencastCompositor> compositor, int cell, int compositeId)
+      : mCompositor(std::move(compositor))
+      , mCell(cell)
+      , mCompositeId(compositeId)
+      , mCapturer(std::move(capturer)) {
+  }
+
+  bool Start() {
+    return mCapturer->Start(this);
+  }
+
+  void Stop() {
+    mCapturer->Stop();
+    mCompositor->removeTile(mCell);
+  }
+
+  int CompositeId() const {
+    return mCompositeId;
+  }
+
+  // Called on the capturer's thread.
+  void OnFrame(const webrtc::VideoFrame& videoFrame) override {
+    mCompositor->onTileFrame(mCell, videoFrame);
+  }
+
+ private:
+  RefPtr<ScreencastCompositor> mCompositor;
+  const int mCell;
+  const int mCompositeId;
+  std::unique_ptr<ScreencastCapturer> mCapturer;
+};
+
+struct nsScreencastService::Composite {
+  RefPtr<ScreencastCompositor> mCompositor;
+  FrameRateOptions mFrameRate;
 };
 
 
@@ -93,59 +466,303 @@ nsScreencastService::nsScreencastService() = default;
 nsScreencastService::~nsScreencastService() {
 }
 
-nsresult nsScreencastService::StartVideoRecording(nsIDocShell* aDocShell, const nsACString& aFileName, int32_t* sessionId) {
+nsresult nsScreencastService::StartVideoRecording(nsIDocShell* aDocShell, const nsACString& aFileName, uint32_t aWidth, uint32_t aHeight, double aScale, nsIScreencastEncoderOptions* aOptions, nsIScreencastStreamListener* aListener, int32_t* sessionId) {
   MOZ_RELEASE_ASSERT(NS_IsMainThread(), "Screencast service must be started on the Main thread.");
   *sessionId = -1;
 
-  PresShell* presShell = aDocShell->GetPresShell();
-  if (!presShell)
-    return NS_ERROR_UNEXPECTED;
-  nsViewManager* viewManager = presShell->GetViewManager();
-  if (!viewManager)
-    return NS_ERROR_UNEXPECTED;
-  nsView* view = viewManager->GetRootView();
-  if (!view)
+  if (aFileName.IsEmpty() && !aListener)
+    return NS_ERROR_INVALID_ARG;
+
+  ScreencastEncoder::Options options;
+  ScreencastOutput::FileOptions fileOptions;
+  FrameRateOptions frameRate;
+  nsresult rv = ReadEncoderOptions(aOptions, options, fileOptions, frameRate);
+  if (NS_FAILED(rv))
+    return rv;
+
+  nsIWidget* widget = GetRootWidget(aDocShell);
+  if (!widget)
     return NS_ERROR_UNEXPECTED;
-  nsIWidget* widget = view->GetWidget();
-
-#ifdef MOZ_WIDGET_GTK
-  mozilla::widget::CompositorWidgetInitData initData;
-  widget->GetCompositorWidgetInitData(&initData);
-  const mozilla::widget::GtkCompositorWidgetInitData& gtkInitData = initData.get_GtkCompositorWidgetInitData();
-  nsCString windowId;
-# ifdef MOZ_X11
-  windowId.AppendPrintf("%lu", gtkInitData.XWindow());
-# else
-  // TODO: support in wayland
-  return NS_ERROR_NOT_IMPLEMENTED;
-# endif
-  *sessionId = ++mLastSessionId;
+
+  LayoutDeviceIntRect bounds = widget->GetClientBounds();
+  int width = aWidth;
+  int height = aHeight;
+  if (!width || !height) {
+    width = bounds.width;
+    height = bounds.height;
+  }
+  // I420 frames must have even dimensions.
+  width &= ~1;
+  height &= ~1;
+  Maybe<double> scale;
+  if (aScale)
+    scale = Some(aScale);
+
+  EnsurePools();
+  std::unique_ptr<ScreencastCapturer> capturer = CreateCapturer(widget, frameRate.maxFPS);
+  if (!capturer)
+    return NS_ERROR_NOT_IMPLEMENTED;
+
   nsCString error;
-  RefPtr<ScreencastEncoder> encoder = ScreencastEncoder::create(error, PromiseFlatCString(aFileName), 1280, 960, Nothing());
+  nsCString fileName(aFileName);
+  std::unique_ptr<ScreencastOutput> output;
+  if (!fileName.IsEmpty()) {
+    output = ScreencastOutput::createFile(error, fileName, fileOptions);
+    if (!output) {
+      fprintf(stderr, "Failed to create screencast output: %s\n", error.get());
+      return NS_ERROR_FAILURE;
+    }
+    output = ScreencastOutput::createAsync(std::move(output), mIOPool);
+  }
+  // The encoder writes the container header, so the file is opened before
+  // the options are fully validated. Do not leave it behind on failure, the
+  // output is closed by the time the encoder creation returns.
+  auto removeFile = MakeScopeExit([&fileName] {
+    if (!fileName.IsEmpty())
+      remove(fileName.get());
+  });
+  RefPtr<StreamWindow> streamWindow;
+  if (aListener) {
+    uint32_t window = 0;
+    rv = aListener->GetWindow(&window);
+    if (NS_FAILED(rv))
+      return rv;
+    streamWindow = new StreamWindow(window);
+    auto stream = std::make_unique<StreamOutput>(aListener, streamWindow);
+    if (output)
+      output = ScreencastOutput::createTee(std::move(output), std::move(stream));
+    else
+      output = std::move(stream);
+  }
+  RefPtr<ScreencastEncoder> encoder = ScreencastEncoder::create(error, std::move(output), width, height, scale, options, mEncoderPool, mBufferPool);
   if (!encoder) {
     fprintf(stderr, "Failed to create ScreencastEncoder: %s\n", error.get());
     return NS_ERROR_FAILURE;
   }
 
-  auto session = std::make_unique<Session>(*sessionId, windowId, std::move(encoder));
-  if (!session->Start())
+  removeFile.release();
+
+  auto session = std::make_unique<Session>(std::move(capturer), std::move(encoder), std::move(streamWindow), frameRate);
+  if (!session->Start()) {
+    // The encoder may still be writing, drop the file once it is done.
+    session->Encoder()->finish([fileName] {
+      if (!fileName.IsEmpty())
+        remove(fileName.get());
+    });
     return NS_ERROR_FAILURE;
+  }
 
+  *sessionId = ++mLastSessionId;
   mIdToSession.emplace(*sessionId, std::move(session));
   return NS_OK;
-#else
-  // TODO: support Windows and Mac.
-  return NS_ERROR_NOT_IMPLEMENTED;
-#endif
+}
+
+nsresult nsScreencastService::StartCompositeRecording(const nsACString& aFileName, uint32_t aTileWidth, uint32_t aTileHeight, uint32_t aColumns, uint32_t aRows, nsIScreencastEncoderOptions* aOptions, int32_t* compositeId) {
+  MOZ_RELEASE_ASSERT(NS_IsMainThread(), "Screencast service must be started on the Main thread.");
+  *compositeId = -1;
+
+  // Cells must start at even coordinates to share the chroma planes.
+  aTileWidth &= ~1;
+  aTileHeight &= ~1;
+  if (aFileName.IsEmpty() || !aTileWidth || !aTileHeight || !aColumns || !aRows ||
+      aColumns > 16384 / aTileWidth || aRows > 16384 / aTileHeight)
+    return NS_ERROR_INVALID_ARG;
+
+  ScreencastEncoder::Options options;
+  ScreencastOutput::FileOptions fileOptions;
+  FrameRateOptions frameRate;
+  nsresult rv = ReadEncoderOptions(aOptions, options, fileOptions, frameRate);
+  if (NS_FAILED(rv))
+    return rv;
+
+  nsCString error;
+  nsCString fileName(aFileName);
+  std::unique_ptr<ScreencastOutput> output = ScreencastOutput::createFile(error, fileName, fileOptions);
+  if (!output) {
+    fprintf(stderr, "Failed to create screencast output: %s\n", error.get());
+    return NS_ERROR_FAILURE;
+  }
+  EnsurePools();
+  output = ScreencastOutput::createAsync(std::move(output), mIOPool);
+  RefPtr<ScreencastEncoder> encoder = ScreencastEncoder::create(error, std::move(output), aColumns * aTileWidth, aRows * aTileHeight, Nothing(), options, mEncoderPool, mBufferPool);
+  if (!encoder) {
+    fprintf(stderr, "Failed to create ScreencastEncoder: %s\n", error.get());
+    // As in StartVideoRecording, the output is closed by now.
+    remove(fileName.get());
+    return NS_ERROR_FAILURE;
+  }
+
+  *compositeId = ++mLastSessionId;
+  auto composite = std::make_unique<Composite>();
+  // WebM carries the tile layout in a tag, IVF has no room for it.
+  nsCString layoutPath;
+  if (options.container == ScreencastEncoder::Container::IVF)
+    layoutPath = fileName + NS_LITERAL_CSTRING(".tiles.json");
+  composite->mCompositor = new ScreencastCompositor(std::move(encoder), aTileWidth, aTileHeight, aColumns, aRows, frameRate.maxFPS, layoutPath, mIOPool);
+  composite->mFrameRate = frameRate;
+  mIdToComposite.emplace(*compositeId, std::move(composite));
+  return NS_OK;
+}
+
+nsresult nsScreencastService::AddCompositeTile(int32_t aCompositeId, nsIDocShell* aDocShell, int32_t* tileId) {
+  MOZ_RELEASE_ASSERT(NS_IsMainThread(), "Screencast service must be started on the Main thread.");
+  *tileId = -1;
+
+  auto it = mIdToComposite.find(aCompositeId);
+  if (it == mIdToComposite.end())
+    return NS_ERROR_INVALID_ARG;
+  nsIWidget* widget = GetRootWidget(aDocShell);
+  if (!widget)
+    return NS_ERROR_UNEXPECTED;
+
+  const RefPtr<ScreencastCompositor>& compositor = it->second->mCompositor;
+  int id = mLastSessionId + 1;
+  int cell = compositor->addTile(id);
+  // The grid is full.
+  if (cell < 0)
+    return NS_ERROR_FAILURE;
+  std::unique_ptr<ScreencastCapturer> capturer = CreateCapturer(widget, it->second->mFrameRate.maxFPS);
+  if (!capturer) {
+    compositor->removeTile(cell);
+    return NS_ERROR_NOT_IMPLEMENTED;
+  }
+  auto tile = std::make_unique<Tile>(std::move(capturer), compositor, cell, aCompositeId);
+  if (!tile->Start()) {
+    compositor->removeTile(cell);
+    return NS_ERROR_FAILURE;
+  }
+
+  *tileId = mLastSessionId = id;
+  mIdToTile.emplace(id, std::move(tile));
+  return NS_OK;
 }
 
 nsresult nsScreencastService::StopVideoRecording(int32_t sessionId) {
+  auto it = mIdToSession.find(sessionId);
+  if (it != mIdToSession.end()) {
+    it->second->Stop();
+    mIdToSession.erase(it);
+    return NS_OK;
+  }
+
+  auto tileIt = mIdToTile.find(sessionId);
+  if (tileIt != mIdToTile.end()) {
+    tileIt->second->Stop();
+    mIdToTile.erase(tileIt);
+    return NS_OK;
+  }
+
+  auto compositeIt = mIdToComposite.find(sessionId);
+  if (compositeIt == mIdToComposite.end())
+    return NS_ERROR_INVALID_ARG;
+  for (auto tile = mIdToTile.begin(); tile != mIdToTile.end();) {
+    if (tile->second->CompositeId() == sessionId) {
+      tile->second->Stop();
+      tile = mIdToTile.erase(tile);
+    } else {
+      ++tile;
+    }
+  }
+  compositeIt->second->mCompositor->finish([] {});
+  mIdToComposite.erase(compositeIt);
+  return NS_OK;
+}
+
+nsresult nsScreencastService::AckVideoStream(int32_t sessionId) {
   auto it = mIdToSession.find(sessionId);
   if (it == mIdToSession.end())
     return NS_ERROR_INVALID_ARG;
-  it->second->Stop();
-  mIdToSession.erase(it);
+  it->second->AckStream();
+  return NS_OK;
+}
+
+nsresult nsScreencastService::GetVideoRecordingStats(int32_t sessionId, nsIScreencastStats** aStats) {
+  ScreencastEncoder* encoder = nullptr;
+  auto it = mIdToSession.find(sessionId);
+  if (it != mIdToSession.end())
+    encoder = it->second->Encoder();
+  auto compositeIt = mIdToComposite.find(sessionId);
+  if (compositeIt != mIdToComposite.end())
+    encoder = compositeIt->second->mCompositor->encoder();
+  if (!encoder)
+    return NS_ERROR_INVALID_ARG;
+  RefPtr<ScreencastStats> stats = new ScreencastStats(encoder->stats(), encoder->backendName());
+  stats.forget(aStats);
+  return NS_OK;
+}
+
+nsresult nsScreencastService::CaptureVideoRecordingFrame(int32_t sessionId, const nsACString& aMimeType, uint32_t aMaxWidth, uint32_t aMaxHeight, uint32_t aQuality, nsIScreencastScreenshotListener* aListener) {
+  auto it = mIdToSession.find(sessionId);
+  if (it == mIdToSession.end() || !aListener)
+    return NS_ERROR_INVALID_ARG;
+  bool jpeg = aMimeType.EqualsLiteral("image/jpeg");
+  if ((!jpeg && !aMimeType.EqualsLiteral("image/png")) || aQuality > 100)
+    return NS_ERROR_INVALID_ARG;
+  rtc::scoped_refptr<webrtc::VideoFrameBuffer> frame = it->second->LatestFrame();
+  // Nothing has been captured yet.
+  if (!frame)
+    return NS_ERROR_NOT_AVAILABLE;
+
+  // Image encoders are created on the main thread, they can be used on any
+  // thread afterwards.
+  nsAutoCString contractId(NS_LITERAL_CSTRING("@mozilla.org/image/encoder;2?type="));
+  contractId.Append(aMimeType);
+  nsCOMPtr<imgIEncoder> encoder = do_CreateInstance(contractId.get());
+  if (!encoder)
+    return NS_ERROR_FAILURE;
+  nsString options;
+  if (jpeg && aQuality) {
+    options.AppendLiteral("quality=");
+    options.AppendInt(aQuality);
+  }
+
+  nsMainThreadPtrHandle<nsIScreencastScreenshotListener> listener(
+      new nsMainThreadPtrHolder<nsIScreencastScreenshotListener>("CaptureVideoRecordingFrame::listener", aListener));
+  return mEncoderPool->Dispatch(NS_NewRunnableFunction("CaptureVideoRecordingFrame", [frame, encoder, options, aMaxWidth, aMaxHeight, listener] {
+    nsCString data;
+    nsresult rv = EncodeScreenshot(frame, encoder, options, aMaxWidth, aMaxHeight, data);
+    NS_DispatchToMainThread(NS_NewRunnableFunction("CaptureVideoRecordingFrame::done", [listener, rv, data = std::move(data)] {
+      if (NS_FAILED(rv)) {
+        nsCString error;
+        error.AppendPrintf("Failed to encode the frame: 0x%08x", static_cast<uint32_t>(rv));
+        listener->OnError(error);
+        return;
+      }
+      listener->OnScreenshot(data);
+    }));
+  }), NS_DISPATCH_NORMAL);
+}
+
+nsresult nsScreencastService::RecoverVideoRecording(const nsACString& aFileName, uint64_t* aFrameCount) {
+  *aFrameCount = 0;
+  nsCString error;
+  if (!ScreencastMuxer::recover(error, PromiseFlatCString(aFileName), *aFrameCount)) {
+    fprintf(stderr, "%s\n", error.get());
+    return NS_ERROR_FAILURE;
+  }
   return NS_OK;
 }
 
+void nsScreencastService::EnsurePools() {
+  if (!mEncoderPool) {
+    // Encoding is CPU bound, more threads than cores would only add
+    // contention between the sessions.
+    int32_t cores = PR_GetNumberOfProcessors();
+    mEncoderPool = SharedThreadPool::Get(NS_LITERAL_CSTRING("Screencast enc"), cores > 0 ? cores : 1);
+  }
+  if (!mIOPool)
+    mIOPool = SharedThreadPool::Get(NS_LITERAL_CSTRING("Screencast IO"), 2);
+  if (!mBufferPool)
+    mBufferPool = new ScreencastBufferPool();
+}
+
+std::unique_ptr<ScreencastCapturer> nsScreencastService::CreateCapturer(nsIWidget* aWidget, int aMaxFPS) {
+  // Prefer reading back our own compositor, it skips the window system and
+  // costs no main thread time. The window capturer covers the GPU process.
+  std::unique_ptr<ScreencastCapturer> capturer = ScreencastCapturer::CreateCompositorCapturer(aWidget, mEncoderPool, mBufferPool, aMaxFPS);
+  if (!capturer)
+    capturer = ScreencastCapturer::CreateWindowCapturer(aWidget, aMaxFPS);
+  return capturer;
+}
+
 }  // namespace mozilla
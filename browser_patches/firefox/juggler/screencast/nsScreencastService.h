@@ -6,10 +6,17 @@
 
 #include <memory>
 #include <unordered_map>
+#include "mozilla/RefPtr.h"
 #include "nsIScreencastService.h"
 
+class nsIWidget;
+
 namespace mozilla {
 
+class ScreencastBufferPool;
+class ScreencastCapturer;
+class SharedThreadPool;
+
 class nsScreencastService final : public nsIScreencastService {
  public:
   NS_DECL_ISUPPORTS
@@ -22,9 +29,25 @@ class nsScreencastService final : public nsIScreencastService {
  private:
   ~nsScreencastService();
 
+  void EnsurePools();
+  std::unique_ptr<ScreencastCapturer> CreateCapturer(nsIWidget* aWidget, int aMaxFPS);
+
   class Session;
+  class Tile;
+  struct Composite;
+  // Threads shared by all sessions for frame conversion and encoding,
+  // created with the first session.
+  RefPtr<SharedThreadPool> mEncoderPool;
+  // Threads writing the output files, so that the encoders never wait for
+  // the disk.
+  RefPtr<SharedThreadPool> mIOPool;
+  // Conversion buffers, reused across frames and sessions.
+  RefPtr<ScreencastBufferPool> mBufferPool;
   int mLastSessionId = 0;
   std::unordered_map<int, std::unique_ptr<Session>> mIdToSession;
+  // Composite recordings and their tiles share the session id space.
+  std::unordered_map<int, std::unique_ptr<Composite>> mIdToComposite;
+  std::unordered_map<int, std::unique_ptr<Tile>> mIdToTile;
 };
 
 }  // namespace mozilla
@@ -31,9 +31,23 @@
 @property (nonatomic, copy) void (^completionHandler)(BOOL accept, NSString* value);
 @end
 
+// Embedder side of a browser context created over the inspector pipe.
+@interface BrowserContextState : NSObject
+@property (nonatomic, strong) _WKBrowserContext *browserContext;
+// Pages of the context are created with it, WKWebView makes its own copy.
+@property (nonatomic, strong) WKWebViewConfiguration *configuration;
+@property (nonatomic, readonly) NSMutableSet *headlessWindows;
+@end
+
 @interface BrowserAppDelegate : NSObject <NSApplicationDelegate, WKNavigationDelegate, WKUIDelegate, _WKBrowserInspectorDelegate, _WKDownloadDelegate> {
     NSMutableSet *_headlessWindows;
-    NSMutableSet *_browserContexts;
+    NSMapTable *_headlessWindowContexts;
+    NSMutableArray *_spareHeadlessWindows;
+    NSSize _headlessViewportSize;
+    NSMutableDictionary *_browserContexts;
+    NSUInteger _processPoolCount;
+    NSMutableArray *_sharedProcessPools;
+    NSUInteger _nextSharedProcessPool;
     bool _headless;
     bool _noStartupWindow;
     NSMutableSet *_dialogs;
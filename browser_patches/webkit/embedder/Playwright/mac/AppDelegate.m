@@ -67,10 +67,35 @@
 }
 @end
 
+@implementation BrowserContextState
+- (id)init
+{
+    self = [super init];
+    if (!self)
+        return nil;
+    _headlessWindows = [[NSMutableSet alloc] init];
+    return self;
+}
+
+- (void)dealloc
+{
+    [_browserContext release];
+    _browserContext = nil;
+    [_configuration release];
+    _configuration = nil;
+    [_headlessWindows release];
+    _headlessWindows = nil;
+    [super dealloc];
+}
+@end
+
 enum {
     _NSBackingStoreUnbuffered = 3
 };
 
+// Closed headless pages leave their host window here for the next page.
+const NSUInteger kSpareHeadlessWindowCount = 4;
+
 NSString* const ActivityReason = @"Batch headless process";
 const NSActivityOptions ActivityOptions =
     (NSActivityUserInitiatedAllowingIdleSystemSleep |
@@ -91,6 +116,7 @@ const NSActivityOptions ActivityOptions =
     _userDataDir = nil;
     _proxyServer = nil;
     _proxyBypassList = nil;
+    _headlessViewportSize = NSMakeSize(1280, 720);
     NSArray *arguments = [[NSProcessInfo processInfo] arguments];
     NSRange subargs = NSMakeRange(1, [arguments count] - 1);
     NSArray *subArray = [arguments subarrayWithRange:subargs];
@@ -110,14 +136,27 @@ const NSActivityOptions ActivityOptions =
             NSRange range = NSMakeRange(20, [argument length] - 20);
             _proxyBypassList = [[argument substringWithRange:range] copy];
         }
+        if ([argument hasPrefix:@"--viewport-size="]) {
+            NSRange range = NSMakeRange(16, [argument length] - 16);
+            NSArray *size = [[argument substringWithRange:range] componentsSeparatedByString:@"x"];
+            if ([size count] == 2 && [size[0] integerValue] > 0 && [size[1] integerValue] > 0)
+                _headlessViewportSize = NSMakeSize([size[0] integerValue], [size[1] integerValue]);
+        }
+        if ([argument hasPrefix:@"--process-pool-count="]) {
+            NSRange range = NSMakeRange(21, [argument length] - 21);
+            _processPoolCount = MAX([[argument substringWithRange:range] integerValue], 0);
+        }
     }
 
     _headless = [arguments containsObject: @"--headless"];
     _noStartupWindow = [arguments containsObject: @"--no-startup-window"];
-    _browserContexts = [[NSMutableSet alloc] init];
+    _browserContexts = [[NSMutableDictionary alloc] init];
+    _sharedProcessPools = [[NSMutableArray alloc] init];
 
     if (_headless) {
         _headlessWindows = [[NSMutableSet alloc] init];
+        _headlessWindowContexts = [[NSMapTable strongToStrongObjectsMapTable] retain];
+        _spareHeadlessWindows = [[NSMutableArray alloc] init];
         [NSApp setActivationPolicy:NSApplicationActivationPolicyAccessory];
         [[NSProcessInfo processInfo] beginActivityWithOptions:ActivityOptions
                                                        reason:ActivityReason];
@@ -265,14 +304,9 @@ const NSActivityOptions ActivityOptions =
 
 - (WKWebViewConfiguration *) sessionConfiguration:(uint64_t)sessionID
 {
-    for (_WKBrowserContext *browserContext in _browserContexts) {
-        if ([[browserContext dataStore] sessionID] != sessionID)
-            continue;
-        WKWebViewConfiguration *configuration = [[[self defaultConfiguration] copy] autorelease];
-        configuration.websiteDataStore = [browserContext dataStore];
-        configuration.processPool = [browserContext processPool];
-        return configuration;
-    }
+    BrowserContextState *state = [_browserContexts objectForKey:@(sessionID)];
+    if (state)
+        return state.configuration;
     return [self defaultConfiguration];
 }
 
@@ -297,12 +331,32 @@ const NSActivityOptions ActivityOptions =
     return [controller webView];
 }
 
-- (WKWebView *)createHeadlessPage:(WKWebViewConfiguration *)configuration withURL:(NSString*)urlString
+- (NSRect)headlessWindowRect
 {
-    NSRect rect = NSMakeRect(0, 0, 1280, 720);
+    NSRect rect = NSMakeRect(0, 0, _headlessViewportSize.width, _headlessViewportSize.height);
     NSScreen *firstScreen = [[NSScreen screens] objectAtIndex:0];
-    NSRect windowRect = NSOffsetRect(rect, -10000, [firstScreen frame].size.height - rect.size.height + 10000);
-    NSWindow* window = [[NSWindow alloc] initWithContentRect:windowRect styleMask:NSWindowStyleMaskBorderless backing:(NSBackingStoreType)_NSBackingStoreUnbuffered defer:YES];
+    return NSOffsetRect(rect, -10000, [firstScreen frame].size.height - rect.size.height + 10000);
+}
+
+- (NSWindow *)takeHeadlessWindow
+{
+    NSWindow *window = [_spareHeadlessWindows lastObject];
+    if (!window) {
+        window = [[[NSWindow alloc] initWithContentRect:[self headlessWindowRect] styleMask:NSWindowStyleMaskBorderless backing:(NSBackingStoreType)_NSBackingStoreUnbuffered defer:YES] autorelease];
+        // Closing only takes the window off screen, the sets own it.
+        [window setReleasedWhenClosed:NO];
+        return window;
+    }
+    [[window retain] autorelease];
+    [_spareHeadlessWindows removeLastObject];
+    // The previous page may have been resized.
+    [window setFrame:[self headlessWindowRect] display:NO];
+    return window;
+}
+
+- (WKWebView *)createHeadlessPage:(WKWebViewConfiguration *)configuration withURL:(NSString*)urlString
+{
+    NSWindow* window = [self takeHeadlessWindow];
 
     WKWebView* webView = [[WKWebView alloc] initWithFrame:[window.contentView bounds] configuration:configuration];
     webView._windowOcclusionDetectionEnabled = NO;
@@ -317,37 +371,103 @@ const NSActivityOptions ActivityOptions =
         [webView loadRequest:[NSURLRequest requestWithURL:url]];
     }
     [_headlessWindows addObject:window];
+    BrowserContextState *state = [_browserContexts objectForKey:@([configuration.websiteDataStore sessionID])];
+    if (state) {
+        [state.headlessWindows addObject:window];
+        [_headlessWindowContexts setObject:state forKey:window];
+    }
     webView.navigationDelegate = self;
     webView.UIDelegate = self;
     return [webView autorelease];
 }
 
-- (_WKBrowserContext *)createBrowserContext:(NSString *)proxyServer WithBypassList:(NSString *) proxyBypassList
+- (WKProcessPool *)createProcessPool:(BOOL)shared
 {
-    _WKBrowserContext *browserContext = [[_WKBrowserContext alloc] init];
     _WKProcessPoolConfiguration *processConfiguration = [[[_WKProcessPoolConfiguration alloc] init] autorelease];
     processConfiguration.forceOverlayScrollbars = YES;
+    // Shared pools launch a spare web process whenever theirs is taken.
+    if (shared)
+        processConfiguration.prewarmsProcessesAutomatically = YES;
+    WKProcessPool *processPool = [[[WKProcessPool alloc] _initWithConfiguration:processConfiguration] autorelease];
+    [processPool _setDownloadDelegate:self];
+    if (shared)
+        [processPool _warmInitialProcess];
+    return processPool;
+}
+
+- (WKProcessPool *)processPoolForBrowserContext
+{
+    // By default every context gets its own processes.
+    if (!_processPoolCount)
+        return [self createProcessPool:NO];
+
+    // With --process-pool-count=N, contexts are spread over at most N pools.
+    // They still have their own data stores, but share the pool's network
+    // process, process cache and prewarmed web processes with the other
+    // contexts of their pool. The primary data store of a shared pool stays
+    // the one of the first context it served, see
+    // InspectorPlaywrightAgent::createContext().
+    if ([_sharedProcessPools count] < _processPoolCount)
+        [_sharedProcessPools addObject:[self createProcessPool:YES]];
+    WKProcessPool *processPool = [_sharedProcessPools objectAtIndex:_nextSharedProcessPool % [_sharedProcessPools count]];
+    _nextSharedProcessPool = (_nextSharedProcessPool + 1) % _processPoolCount;
+
+    // The pool of the next context gets its web process ready in the meantime.
+    // Prewarmed processes are launched without a data store and adopt the one
+    // of the page that takes them, so this helps whichever context comes next.
+    if (_nextSharedProcessPool < [_sharedProcessPools count])
+        [[_sharedProcessPools objectAtIndex:_nextSharedProcessPool] _warmInitialProcess];
+    return processPool;
+}
+
+- (_WKBrowserContext *)createBrowserContext:(NSString *)proxyServer WithBypassList:(NSString *) proxyBypassList
+{
+    _WKBrowserContext *browserContext = [[_WKBrowserContext alloc] init];
     _WKWebsiteDataStoreConfiguration *dataStoreConfiguration = [[[_WKWebsiteDataStoreConfiguration alloc] initNonPersistentConfiguration] autorelease];
     if (!proxyServer || ![proxyServer length])
         proxyServer = _proxyServer;
     if (!proxyBypassList || ![proxyBypassList length])
         proxyBypassList = _proxyBypassList;
     [dataStoreConfiguration setProxyConfiguration:[self proxyConfiguration:proxyServer WithBypassList:proxyBypassList]];
-    browserContext.dataStore = [[WKWebsiteDataStore alloc] _initWithConfiguration:dataStoreConfiguration];
-    browserContext.processPool = [[[WKProcessPool alloc] _initWithConfiguration:processConfiguration] autorelease];
-    [browserContext.processPool _setDownloadDelegate:self];
-    [_browserContexts addObject:browserContext];
+    browserContext.dataStore = [[[WKWebsiteDataStore alloc] _initWithConfiguration:dataStoreConfiguration] autorelease];
+    browserContext.processPool = [self processPoolForBrowserContext];
+
+    BrowserContextState *state = [[[BrowserContextState alloc] init] autorelease];
+    state.browserContext = browserContext;
+    state.configuration = [[[self defaultConfiguration] copy] autorelease];
+    state.configuration.websiteDataStore = browserContext.dataStore;
+    state.configuration.processPool = browserContext.processPool;
+    [_browserContexts setObject:state forKey:@([browserContext.dataStore sessionID])];
     return browserContext;
 }
 
 - (void)deleteBrowserContext:(uint64_t)sessionID
 {
-    for (_WKBrowserContext *browserContext in _browserContexts) {
-        if ([[browserContext dataStore] sessionID] != sessionID)
-            continue;
-        [_browserContexts removeObject:browserContext];
+    BrowserContextState *state = [_browserContexts objectForKey:@(sessionID)];
+    if (!state)
         return;
+    // Pages of the context may still be closing, webViewDidClose: recycles
+    // their windows once they are gone. Only the windows that no longer host
+    // a page are released right away.
+    for (NSWindow *window in [[state.headlessWindows copy] autorelease]) {
+        if (![[window.contentView subviews] count])
+            [self closeHeadlessWindow:window];
+        else
+            [_headlessWindowContexts removeObjectForKey:window];
     }
+    [_browserContexts removeObjectForKey:@(sessionID)];
+}
+
+- (void)closeHeadlessWindow:(NSWindow *)window
+{
+    BrowserContextState *state = [_headlessWindowContexts objectForKey:window];
+    [state.headlessWindows removeObject:window];
+    [_headlessWindowContexts removeObjectForKey:window];
+    [[window.contentView subviews] makeObjectsPerformSelector:@selector(removeFromSuperview)];
+    [window close];
+    if ([_spareHeadlessWindows count] < kSpareHeadlessWindowCount)
+        [_spareHeadlessWindows addObject:window];
+    [_headlessWindows removeObject:window];
 }
 
 - (void)quit
@@ -358,14 +478,10 @@ const NSActivityOptions ActivityOptions =
 #pragma mark WKUIDelegate
 
 - (void)webViewDidClose:(WKWebView *)webView {
-    for (NSWindow *window in _headlessWindows) {
-        if (webView.window != window)
-            continue;
-        [webView removeFromSuperview];
-        [window close];
-        [_headlessWindows removeObject:window];
-        break;
-    }
+    NSWindow *window = webView.window;
+    if (!window || ![_headlessWindows containsObject:window])
+        return;
+    [self closeHeadlessWindow:window];
 }
 
 - (void)webView:(WKWebView *)webView runJavaScriptAlertPanelWithMessage:(NSString *)message initiatedByFrame:(WKFrameInfo *)frame completionHandler:(void (^)(void))completionHandler
@@ -63,6 +63,37 @@ void computeFullDesktopFrame()
     s_windowSize.cy = scaleFactor * (desktop.bottom - desktop.top);
 }
 
+// Only the toolbar and the dialogs need them, which headless automation
+// usually never shows.
+void initializeCommonControls()
+{
+    static bool initialized = false;
+    if (initialized)
+        return;
+    initialized = true;
+
+    INITCOMMONCONTROLSEX InitCtrlEx;
+    InitCtrlEx.dwSize = sizeof(INITCOMMONCONTROLSEX);
+    InitCtrlEx.dwICC  = 0x00004000; // ICC_STANDARD_CLASSES;
+    InitCommonControlsEx(&InitCtrlEx);
+}
+
+void traceStartupPhase(const char* phase)
+{
+    static bool enabled = GetEnvironmentVariableW(L"PLAYWRIGHT_STARTUP_TRACE", nullptr, 0) > 0;
+    if (!enabled)
+        return;
+
+    FILETIME creationTime, exitTime, kernelTime, userTime, now;
+    if (!GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime))
+        return;
+    GetSystemTimePreciseAsFileTime(&now);
+    ULARGE_INTEGER start = { creationTime.dwLowDateTime, creationTime.dwHighDateTime };
+    ULARGE_INTEGER current = { now.dwLowDateTime, now.dwHighDateTime };
+    // FILETIME counts 100ns intervals.
+    fprintf(stderr, "[startup] %s: %.2fms\n", phase, (current.QuadPart - start.QuadPart) / 10000.0);
+}
+
 BOOL WINAPI DllMain(HINSTANCE dllInstance, DWORD reason, LPVOID)
 {
     if (reason == DLL_PROCESS_ATTACH)
@@ -141,6 +172,7 @@ Optional<Credential> askCredential(HWND hwnd, const std::wstring& realm)
         }
     };
 
+    initializeCommonControls();
     AuthDialog dialog;
     dialog.realm = realm;
 
@@ -173,6 +205,7 @@ bool askServerTrustEvaluation(HWND hwnd, const std::wstring& text)
         }
     };
 
+    initializeCommonControls();
     ServerTrustEvaluationDialog dialog { text };
     return dialog.run(hInst, hwnd, IDD_SERVER_TRUST);
 }
@@ -198,6 +231,16 @@ CommandLineOptions parseCommandLine()
             options.headless = true;
         else if (!wcsicmp(argv[i], L"--no-startup-window"))
             options.noStartupWindow = true;
+        else if (!wcsicmp(argv[i], L"--ignore-certificate-errors"))
+            options.ignoreCertificateErrors = true;
+        else if (!wcsicmp(argv[i], L"--ephemeral"))
+            options.ephemeral = true;
+        else if (!wcsicmp(argv[i], L"--cache-model=document-viewer"))
+            options.cacheModel = kWKCacheModelDocumentViewer;
+        else if (!wcsicmp(argv[i], L"--cache-model=document-browser"))
+            options.cacheModel = kWKCacheModelDocumentBrowser;
+        else if (!wcsicmp(argv[i], L"--cache-model=primary-web-browser"))
+            options.cacheModel = kWKCacheModelPrimaryWebBrowser;
         else if (!options.requestedURL)
             options.requestedURL = argv[i];
     }
@@ -26,6 +26,7 @@
 #pragma once
 
 #include "stdafx.h"
+#include <WebKit/WKContext.h>
 #include <WebKit/WKRetainPtr.h>
 #include <WebKit/WKString.h>
 #include <WebKit/WKURL.h>
@@ -36,6 +37,11 @@ struct CommandLineOptions {
     bool inspectorPipe { };
     bool headless { };
     bool noStartupWindow { };
+    bool ignoreCertificateErrors { };
+    // Keeps the startup context's website data in memory only, protocol
+    // contexts always do.
+    bool ephemeral { };
+    Optional<WKCacheModel> cacheModel;
     _bstr_t requestedURL;
     _bstr_t userDataDir;
     _bstr_t curloptProxy;
@@ -52,6 +58,10 @@ struct Credential {
 };
 
 void computeFullDesktopFrame();
+void initializeCommonControls();
+// Logs |phase| with the time since process creation to stderr when the
+// PLAYWRIGHT_STARTUP_TRACE environment variable is set.
+void traceStartupPhase(const char* phase);
 bool getAppDataFolder(_bstr_t& directory);
 CommandLineOptions parseCommandLine();
 void createCrashReport(EXCEPTION_POINTERS*);
@@ -28,7 +28,10 @@
 #include "MainWindow.h"
 #include "PlaywrightLibResource.h"
 #include "WebKitBrowserWindow.h"
+#include <WebKit/WKPageConfigurationRef.h>
+#include <algorithm>
 #include <sstream>
+#include <unordered_map>
 
 namespace WebCore {
 float deviceScaleFactorForWindow(HWND);
@@ -39,6 +42,22 @@ static const wchar_t* kPlaywrightRegistryKey = L"Software\\WebKit\\Playwright";
 static constexpr int kToolbarImageSize = 24;
 static constexpr int kToolbarURLBarIndex = 3;
 
+static const wchar_t* kHeadlessWindowClass = L"PlaywrightHeadless";
+// Initial size of headless pages, the protocol resizes them as needed.
+static constexpr SIZE kHeadlessWindowSize = { 1280, 720 };
+// Native windows kept ready for the next pages under automation.
+static constexpr size_t kWindowPoolSize = 2;
+
+// Pages of a context share one page group and one preferences object. An
+// entry lives as long as windows of its context do, which keep the context
+// alive through their page configuration.
+struct ContextPageSettings {
+    WKRetainPtr<WKPageGroupRef> pageGroup;
+    WKRetainPtr<WKPreferencesRef> preferences;
+    size_t windowCount { 0 };
+};
+static std::unordered_map<WKContextRef, ContextPageSettings> s_contextPageSettings;
+
 static WNDPROC DefEditProc = nullptr;
 
 static LRESULT CALLBACK EditProc(HWND, UINT, WPARAM, LPARAM);
@@ -46,9 +65,12 @@ static INT_PTR CALLBACK About(HWND, UINT, WPARAM, LPARAM);
 
 std::wstring MainWindow::s_windowClass;
 size_t MainWindow::s_numInstances;
+std::unordered_set<HWND> MainWindow::s_instanceWindows;
 
 bool MainWindow::s_headless = false;
 bool MainWindow::s_noStartupWindow = false;
+std::vector<MainWindow*> MainWindow::s_windowPool;
+UINT_PTR MainWindow::s_refillTimer = 0;
 
 void MainWindow::configure(bool headless, bool noStartupWindow) {
     s_headless = headless;
@@ -70,6 +92,19 @@ void MainWindow::registerClass(HINSTANCE hInstance)
         return;
     initialized = true;
 
+    if (s_headless) {
+        // Headless windows are never shown, they need no menu, icons or
+        // redraw on resize.
+        s_windowClass = kHeadlessWindowClass;
+        WNDCLASSEX wcex = { };
+        wcex.cbSize = sizeof(WNDCLASSEX);
+        wcex.lpfnWndProc = WndProc;
+        wcex.hInstance = hInstance;
+        wcex.lpszClassName = s_windowClass.c_str();
+        RegisterClassEx(&wcex);
+        return;
+    }
+
     s_windowClass = loadString(IDC_PLAYWRIGHT);
 
     WNDCLASSEX wcex;
@@ -89,12 +124,10 @@ void MainWindow::registerClass(HINSTANCE hInstance)
     RegisterClassEx(&wcex);
 }
 
+// Called for every message the loop dispatches, so no class name lookup.
 bool MainWindow::isInstance(HWND hwnd)
 {
-    wchar_t buff[64];
-    if (!GetClassName(hwnd, buff, _countof(buff)))
-        return false;
-    return s_windowClass == buff;
+    return s_instanceWindows.count(hwnd);
 }
 
 MainWindow::MainWindow()
@@ -105,10 +138,49 @@ MainWindow::MainWindow()
 MainWindow::~MainWindow()
 {
     s_numInstances--;
+    s_windowPool.erase(std::remove(s_windowPool.begin(), s_windowPool.end(), this), s_windowPool.end());
+    if (!m_context)
+        return;
+    auto it = s_contextPageSettings.find(m_context);
+    if (it != s_contextPageSettings.end() && !--it->second.windowCount)
+        s_contextPageSettings.erase(it);
+}
+
+MainWindow* MainWindow::create()
+{
+    // Only automation creates pages often enough to be worth it, and there
+    // spare windows do not keep the process alive.
+    if (!s_headless || !s_noStartupWindow)
+        return new MainWindow();
+
+    MainWindow* window = nullptr;
+    if (!s_windowPool.empty()) {
+        window = s_windowPool.back();
+        s_windowPool.pop_back();
+    }
+    // Refill once the caller is done rather than on its critical path.
+    if (!s_refillTimer)
+        s_refillTimer = SetTimer(nullptr, 0, 0, refillWindowPool);
+    return window ? window : new MainWindow();
+}
+
+void CALLBACK MainWindow::refillWindowPool(HWND, UINT, UINT_PTR id, DWORD)
+{
+    KillTimer(nullptr, id);
+    s_refillTimer = 0;
+    while (s_windowPool.size() < kWindowPoolSize) {
+        auto* window = new MainWindow();
+        if (!window->createWindow(hInst)) {
+            delete window;
+            return;
+        }
+        s_windowPool.push_back(window);
+    }
 }
 
 void MainWindow::createToolbar(HINSTANCE hInstance)
 {
+    initializeCommonControls();
     m_hToolbarWnd = CreateWindowEx(0, TOOLBARCLASSNAME, nullptr, 
         WS_CHILD | WS_BORDER | TBSTYLE_FLAT | TBSTYLE_LIST | TBSTYLE_TOOLTIPS, 0, 0, 0, 0, 
         m_hMainWnd, nullptr, hInstance, nullptr);
@@ -175,24 +247,51 @@ void MainWindow::rescaleToolbar()
 
 bool MainWindow::init(HINSTANCE hInstance, WKPageConfigurationRef conf)
 {
-    auto pageGroup = adoptWK(WKPageGroupCreateWithIdentifier(createWKString("WinPlaywright").get()));
-    auto prefs = adoptWK(WKPreferencesCreate());
-
-    WKPageConfigurationSetPageGroup(conf, pageGroup.get());
-    WKPageConfigurationSetPreferences(conf, prefs.get());
-    WKPageGroupSetPreferences(pageGroup.get(), prefs.get());
+    m_context = WKPageConfigurationGetContext(conf);
+    auto& settings = s_contextPageSettings[m_context];
+    if (!settings.pageGroup) {
+        settings.pageGroup = adoptWK(WKPageGroupCreateWithIdentifier(createWKString("WinPlaywright").get()));
+        settings.preferences = adoptWK(WKPreferencesCreate());
+        WKPageGroupSetPreferences(settings.pageGroup.get(), settings.preferences.get());
+        WKPreferencesSetMediaCapabilitiesEnabled(settings.preferences.get(), false);
+        WKPreferencesSetDeveloperExtrasEnabled(settings.preferences.get(), true);
+    }
+    settings.windowCount++;
 
-    WKPreferencesSetMediaCapabilitiesEnabled(prefs.get(), false);
-    WKPreferencesSetDeveloperExtrasEnabled(prefs.get(), true);
+    WKPageConfigurationSetPageGroup(conf, settings.pageGroup.get());
+    WKPageConfigurationSetPreferences(conf, settings.preferences.get());
 
     m_configuration = conf;
 
-    registerClass(hInstance);
+    if (!m_hMainWnd && !createWindow(hInstance))
+        return false;
 
-    auto title = loadString(IDS_APP_TITLE);
+    m_browserWindow.reset(new WebKitBrowserWindow(*this, m_hMainWnd, conf));
 
-    m_hMainWnd = CreateWindowExW(s_headless ? WS_EX_NOACTIVATE : 0, s_windowClass.c_str(), title.c_str(),
-        WS_OVERLAPPEDWINDOW, CW_USEDEFAULT, 0, CW_USEDEFAULT, 0, 0, 0, hInstance, this);
+    updateDeviceScaleFactor();
+    resizeSubViews();
+
+    if (!s_headless) {
+        SetFocus(m_hURLBarWnd);
+        ShowWindow(m_hMainWnd, SW_SHOW);
+    }
+    return true;
+}
+
+bool MainWindow::createWindow(HINSTANCE hInstance)
+{
+    registerClass(hInstance);
+
+    if (s_headless) {
+        // A message-only window takes no space on the desktop and has no
+        // frame, so the client area is the page size set by the protocol.
+        m_hMainWnd = CreateWindowExW(WS_EX_NOACTIVATE, s_windowClass.c_str(), nullptr,
+            0, 0, 0, kHeadlessWindowSize.cx, kHeadlessWindowSize.cy, HWND_MESSAGE, 0, hInstance, this);
+    } else {
+        auto title = loadString(IDS_APP_TITLE);
+        m_hMainWnd = CreateWindowExW(0, s_windowClass.c_str(), title.c_str(),
+            WS_OVERLAPPEDWINDOW, CW_USEDEFAULT, 0, CW_USEDEFAULT, 0, 0, 0, hInstance, this);
+    }
 
     if (!m_hMainWnd)
         return false;
@@ -202,23 +301,14 @@ bool MainWindow::init(HINSTANCE hInstance, WKPageConfigurationRef conf)
       if (!m_hToolbarWnd)
           return false;
     }
-
-    m_browserWindow.reset(new WebKitBrowserWindow(*this, m_hMainWnd, conf));
-
-    updateDeviceScaleFactor();
-    resizeSubViews();
-
-    if (s_headless) {
-        SetMenu(m_hMainWnd, NULL);
-    } else {
-        SetFocus(m_hURLBarWnd);
-        ShowWindow(m_hMainWnd, SW_SHOW);
-    }
     return true;
 }
 
 void MainWindow::resizeSubViews()
 {
+    // Pooled windows have no page yet.
+    if (!m_browserWindow)
+        return;
     RECT rcClient;
     GetClientRect(m_hMainWnd, &rcClient);
     if (s_headless) {
@@ -253,6 +343,7 @@ LRESULT CALLBACK MainWindow::WndProc(HWND hWnd, UINT message, WPARAM wParam, LPA
         break;
     case WM_CREATE:
         SetWindowLongPtr(hWnd, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(reinterpret_cast<LPCREATESTRUCT>(lParam)->lpCreateParams));
+        s_instanceWindows.insert(hWnd);
         break;
     case WM_APPCOMMAND: {
         auto cmd = GET_APPCOMMAND_LPARAM(lParam);
@@ -327,6 +418,7 @@ LRESULT CALLBACK MainWindow::WndProc(HWND hWnd, UINT message, WPARAM wParam, LPA
         break;
     case WM_NCDESTROY:
         SetWindowLongPtr(hWnd, GWLP_USERDATA, 0);
+        s_instanceWindows.erase(hWnd);
         delete thisWindow;
         if (s_noStartupWindow || s_numInstances > 0)
             return 0;
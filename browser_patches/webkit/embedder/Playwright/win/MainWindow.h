@@ -32,6 +32,8 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <unordered_set>
+#include <vector>
 
 class MainWindow : public BrowserWindowClient {
 public:
@@ -41,6 +43,9 @@ public:
 
     ~MainWindow();
     bool init(HINSTANCE hInstance, WKPageConfigurationRef);
+    // Returns a window whose native window is already created when one is
+    // pooled, a new one otherwise. Call init() on it.
+    static MainWindow* create();
 
     void resizeSubViews();
     HWND hwnd() const { return m_hMainWnd; }
@@ -53,10 +58,16 @@ public:
 private:
     static LRESULT CALLBACK WndProc(HWND, UINT, WPARAM, LPARAM);
     static void registerClass(HINSTANCE hInstance);
+    static void CALLBACK refillWindowPool(HWND, UINT, UINT_PTR, DWORD);
     static std::wstring s_windowClass;
     static size_t s_numInstances;
+    static std::unordered_set<HWND> s_instanceWindows;
     static bool s_headless;
     static bool s_noStartupWindow;
+    static std::vector<MainWindow*> s_windowPool;
+    static UINT_PTR s_refillTimer;
+
+    bool createWindow(HINSTANCE);
 
     bool toggleMenuItem(UINT menuID);
     void onURLBarEnter();
@@ -79,5 +90,6 @@ private:
     // make sure view is deleted after the page.
     std::unique_ptr<WebKitBrowserWindow> m_browserWindow;
     WKRetainPtr<WKPageConfigurationRef> m_configuration;
+    WKContextRef m_context { nullptr };
     int m_toolbarItemsWidth { };
 };
@@ -34,12 +34,21 @@
 #include <WebKit/WKCredential.h>
 #include <WebKit/WKFramePolicyListener.h>
 #include <WebKit/WKInspector.h>
+#include <WebKit/WKPageConfigurationRef.h>
 #include <WebKit/WKProtectionSpace.h>
 #include <WebKit/WKProtectionSpaceCurl.h>
 #include <WebKit/WKWebsiteDataStoreRef.h>
 #include <WebKit/WKWebsiteDataStoreRefCurl.h>
+#include <bcrypt.h>
 #include <vector>
 
+bool WebKitBrowserWindow::s_ignoreCertificateErrors = false;
+
+void WebKitBrowserWindow::configure(bool ignoreCertificateErrors)
+{
+    s_ignoreCertificateErrors = ignoreCertificateErrors;
+}
+
 std::wstring createPEMString(WKCertificateInfoRef certificateInfo)
 {
     auto chainSize = WKCertificateInfoGetCertificateChainSize(certificateInfo);
@@ -58,9 +67,63 @@ std::wstring createPEMString(WKCertificateInfoRef certificateInfo)
     return replaceString(pems, L"\n", L"\r\n");
 }
 
+// SHA-256 of the certificate chain, empty on failure.
+static std::string createFingerprint(WKCertificateInfoRef certificateInfo)
+{
+    static BCRYPT_ALG_HANDLE algorithm = [] {
+        BCRYPT_ALG_HANDLE handle = nullptr;
+        if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&handle, BCRYPT_SHA256_ALGORITHM, nullptr, 0)))
+            return static_cast<BCRYPT_ALG_HANDLE>(nullptr);
+        return handle;
+    }();
+    if (!algorithm)
+        return { };
+
+    BCRYPT_HASH_HANDLE hash = nullptr;
+    if (!BCRYPT_SUCCESS(BCryptCreateHash(algorithm, &hash, nullptr, 0, nullptr, 0, 0)))
+        return { };
+
+    bool success = true;
+    auto chainSize = WKCertificateInfoGetCertificateChainSize(certificateInfo);
+    for (auto i = 0; success && i < chainSize; i++) {
+        auto certificate = adoptWK(WKCertificateInfoCopyCertificateAtIndex(certificateInfo, i));
+        // Hash the sizes too, so that the way the chain splits into
+        // certificates is part of the fingerprint.
+        ULONG size = static_cast<ULONG>(WKDataGetSize(certificate.get()));
+        success = BCRYPT_SUCCESS(BCryptHashData(hash, reinterpret_cast<PUCHAR>(&size), sizeof(size), 0))
+            && BCRYPT_SUCCESS(BCryptHashData(hash, const_cast<PUCHAR>(WKDataGetBytes(certificate.get())), size, 0));
+    }
+
+    std::string fingerprint(32, '\0');
+    if (success)
+        success = BCRYPT_SUCCESS(BCryptFinishHash(hash, reinterpret_cast<PUCHAR>(&fingerprint[0]), static_cast<ULONG>(fingerprint.size()), 0));
+    BCryptDestroyHash(hash);
+    return success ? fingerprint : std::string();
+}
+
+std::shared_ptr<WebKitBrowserWindow::ServerTrustCache> WebKitBrowserWindow::serverTrustCache(WKWebsiteDataStoreRef dataStore)
+{
+    // Pages keep their data store alive, so a live cache is never found
+    // through the address of a destroyed data store.
+    static std::unordered_map<WKWebsiteDataStoreRef, std::weak_ptr<ServerTrustCache>> caches;
+    if (auto cache = caches[dataStore].lock())
+        return cache;
+
+    for (auto it = caches.begin(); it != caches.end();) {
+        if (it->first != dataStore && it->second.expired())
+            it = caches.erase(it);
+        else
+            ++it;
+    }
+    auto cache = std::make_shared<ServerTrustCache>();
+    caches[dataStore] = cache;
+    return cache;
+}
+
 WebKitBrowserWindow::WebKitBrowserWindow(BrowserWindowClient& client, HWND mainWnd, WKPageConfigurationRef conf)
     : m_client(client)
     , m_hMainWnd(mainWnd)
+    , m_serverTrustCache(serverTrustCache(WKPageConfigurationGetWebsiteDataStore(conf)))
 {
     RECT rect = { };
     m_view = adoptWK(WKViewCreate(rect, conf, mainWnd));
@@ -229,7 +292,7 @@ void WebKitBrowserWindow::didReceiveAuthenticationChallenge(WKPageRef page, WKAu
     auto authenticationScheme = WKProtectionSpaceGetAuthenticationScheme(protectionSpace);
 
     if (authenticationScheme == kWKProtectionSpaceAuthenticationSchemeServerTrustEvaluationRequested) {
-        if (thisWindow.canTrustServerCertificate(protectionSpace)) {
+        if (s_ignoreCertificateErrors || thisWindow.canTrustServerCertificate(protectionSpace)) {
             WKRetainPtr<WKStringRef> username = createWKString("accept server trust");
             WKRetainPtr<WKStringRef> password = createWKString("");
             WKRetainPtr<WKCredentialRef> wkCredential = adoptWK(WKCredentialCreate(username.get(), password.get(), kWKCredentialPersistenceForSession));
@@ -255,21 +318,23 @@ bool WebKitBrowserWindow::canTrustServerCertificate(WKProtectionSpaceRef protect
 {
     auto host = createString(adoptWK(WKProtectionSpaceCopyHost(protectionSpace)).get());
     auto certificateInfo = adoptWK(WKProtectionSpaceCopyCertificateInfo(protectionSpace));
-    auto verificationError = WKCertificateInfoGetVerificationError(certificateInfo.get());
-    auto description = createString(adoptWK(WKCertificateInfoCopyVerificationErrorDescription(certificateInfo.get())).get());
-    auto pem = createPEMString(certificateInfo.get());
+    auto fingerprint = createFingerprint(certificateInfo.get());
 
-    auto it = m_acceptedServerTrustCerts.find(host);
-    if (it != m_acceptedServerTrustCerts.end() && it->second == pem)
+    auto it = m_serverTrustCache->find(host);
+    if (!fingerprint.empty() && it != m_serverTrustCache->end() && it->second.count(fingerprint))
         return true;
 
+    // The text is only needed for the dialog.
+    auto verificationError = WKCertificateInfoGetVerificationError(certificateInfo.get());
+    auto description = createString(adoptWK(WKCertificateInfoCopyVerificationErrorDescription(certificateInfo.get())).get());
     std::wstring textString = L"[HOST] " + host + L"\r\n";
     textString.append(L"[ERROR] " + std::to_wstring(verificationError) + L"\r\n");
     textString.append(L"[DESCRIPTION] " + description + L"\r\n");
-    textString.append(pem);
+    textString.append(createPEMString(certificateInfo.get()));
 
     if (askServerTrustEvaluation(hwnd(), textString)) {
-        m_acceptedServerTrustCerts.emplace(host, pem);
+        if (!fingerprint.empty())
+            (*m_serverTrustCache)[host].insert(fingerprint);
         return true;
     }
 
@@ -346,7 +411,7 @@ WKPageRef WebKitBrowserWindow::createPageCallback(WKPageConfigurationRef configu
 
 WKPageRef WebKitBrowserWindow::createViewCallback(WKPageConfigurationRef configuration, bool navigate)
 {
-    auto* newWindow = new MainWindow();
+    auto* newWindow = MainWindow::create();
     bool ok = newWindow->init(hInst, configuration);
     if (navigate)
         newWindow->browserWindow()->loadURL(_bstr_t("about:blank").GetBSTR());
@@ -27,7 +27,9 @@
 #include "Common.h"
 #include <WebKit/WKBase.h>
 #include <WebKit/WebKit2_C.h>
+#include <memory>
 #include <unordered_map>
+#include <unordered_set>
 
 class BrowserWindowClient {
 public:
@@ -37,6 +39,8 @@ public:
 class WebKitBrowserWindow {
 public:
     static WKPageRef createPageCallback(WKPageConfigurationRef);
+    // Accepts every server certificate without asking.
+    static void configure(bool ignoreCertificateErrors);
     WebKitBrowserWindow(BrowserWindowClient&, HWND mainWnd, WKPageConfigurationRef);
     ~WebKitBrowserWindow();
 
@@ -73,10 +77,16 @@ private:
     static void didNotHandleKeyEvent(WKPageRef, WKNativeEventPtr, const void*);
     static void decidePolicyForResponse(WKPageRef, WKFrameRef, WKURLResponseRef, WKURLRequestRef, WKFramePolicyListenerRef, WKTypeRef, const void*);
 
+    // Fingerprints of the accepted certificate chains by host.
+    using ServerTrustCache = std::unordered_map<std::wstring, std::unordered_set<std::string>>;
+    static std::shared_ptr<ServerTrustCache> serverTrustCache(WKWebsiteDataStoreRef);
+    static bool s_ignoreCertificateErrors;
+
     BrowserWindowClient& m_client;
     WKRetainPtr<WKViewRef> m_view;
     HWND m_hMainWnd { nullptr };
-    std::unordered_map<std::wstring, std::wstring> m_acceptedServerTrustCerts;
+    // Shared with the other pages of the data store.
+    std::shared_ptr<ServerTrustCache> m_serverTrustCache;
     WKPageRunJavaScriptAlertResultListenerRef m_alertDialog = { };
     WKPageRunJavaScriptConfirmResultListenerRef m_confirmDialog = { };
     WKPageRunJavaScriptPromptResultListenerRef m_promptDialog = { };
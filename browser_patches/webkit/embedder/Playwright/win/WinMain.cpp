@@ -60,7 +60,10 @@ static std::string toUTF8String(const wchar_t* src, size_t srcLength)
     return { buffer.data(), actualLength };
 }
 
-static void configureDataStore(WKWebsiteDataStoreRef dataStore) {
+static void configureDataStore(WKContextRef context, WKWebsiteDataStoreRef dataStore) {
+    // The cache model also sizes the memory and network caches.
+    if (g_options.cacheModel)
+        WKContextSetCacheModel(context, *g_options.cacheModel);
     if (g_options.curloptProxy.length()) {
         auto curloptProxy = createWKURL(g_options.curloptProxy);
         auto curloptNoproxy = createWKString(g_options.curloptNoproxy);
@@ -76,51 +79,55 @@ int WINAPI wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
 #endif
 
     MSG msg { };
-    HACCEL hAccelTable, hPreAccelTable;
-
-    INITCOMMONCONTROLSEX InitCtrlEx;
-
-    InitCtrlEx.dwSize = sizeof(INITCOMMONCONTROLSEX);
-    InitCtrlEx.dwICC  = 0x00004000; // ICC_STANDARD_CLASSES;
-    InitCommonControlsEx(&InitCtrlEx);
+    HACCEL hAccelTable = nullptr, hPreAccelTable = nullptr;
 
+    traceStartupPhase("wWinMain");
     g_options = parseCommandLine();
     if (g_options.inspectorPipe) {
         WKInspectorInitializeRemoteInspectorPipe(
             configureDataStore,
             WebKitBrowserWindow::createPageCallback,
             []() { PostQuitMessage(0); });
+        traceStartupPhase("inspector pipe");
     }
 
     if (g_options.useFullDesktop)
         computeFullDesktopFrame();
 
-    // Init COM
+    // Init COM. Headless pages still need OLE for drag and drop and the
+    // clipboard.
     OleInitialize(nullptr);
+    traceStartupPhase("OLE");
 
     if (SetProcessDpiAwarenessContextPtr())
         SetProcessDpiAwarenessContextPtr()(DPI_AWARENESS_CONTEXT_UNAWARE);
 
     MainWindow::configure(g_options.headless, g_options.noStartupWindow);
+    WebKitBrowserWindow::configure(g_options.ignoreCertificateErrors);
 
     if (!g_options.noStartupWindow) {
-        auto configuration = adoptWK(WKWebsiteDataStoreConfigurationCreate());
-        if (g_options.userDataDir.length()) {
-            std::string profileFolder = toUTF8String(g_options.userDataDir, g_options.userDataDir.length());
-            WKWebsiteDataStoreConfigurationSetApplicationCacheDirectory(configuration.get(), toWK(profileFolder + "\\ApplicationCache").get());
-            WKWebsiteDataStoreConfigurationSetNetworkCacheDirectory(configuration.get(), toWK(profileFolder + "\\Cache").get());
-            WKWebsiteDataStoreConfigurationSetCacheStorageDirectory(configuration.get(), toWK(profileFolder + "\\CacheStorage").get());
-            WKWebsiteDataStoreConfigurationSetIndexedDBDatabaseDirectory(configuration.get(), toWK(profileFolder + "\\Databases" + "\\IndexedDB").get());
-            WKWebsiteDataStoreConfigurationSetLocalStorageDirectory(configuration.get(), toWK(profileFolder + "\\LocalStorage").get());
-            WKWebsiteDataStoreConfigurationSetWebSQLDatabaseDirectory(configuration.get(), toWK(profileFolder + "\\Databases" + "\\WebSQL").get());
-            WKWebsiteDataStoreConfigurationSetMediaKeysStorageDirectory(configuration.get(), toWK(profileFolder + "\\MediaKeys").get());
-            WKWebsiteDataStoreConfigurationSetResourceLoadStatisticsDirectory(configuration.get(), toWK(profileFolder + "\\ResourceLoadStatistics").get());
-            WKWebsiteDataStoreConfigurationSetServiceWorkerRegistrationDirectory(configuration.get(), toWK(profileFolder + "\\ServiceWorkers").get());
-        }
         auto context = adoptWK(WKContextCreateWithConfiguration(nullptr));
-        auto dataStore = adoptWK(WKWebsiteDataStoreCreateWithConfiguration(configuration.get()));
+        WKRetainPtr<WKWebsiteDataStoreRef> dataStore;
+        if (g_options.ephemeral) {
+            dataStore = adoptWK(WKWebsiteDataStoreCreateNonPersistent());
+        } else {
+            auto configuration = adoptWK(WKWebsiteDataStoreConfigurationCreate());
+            if (g_options.userDataDir.length()) {
+                std::string profileFolder = toUTF8String(g_options.userDataDir, g_options.userDataDir.length());
+                WKWebsiteDataStoreConfigurationSetApplicationCacheDirectory(configuration.get(), toWK(profileFolder + "\\ApplicationCache").get());
+                WKWebsiteDataStoreConfigurationSetNetworkCacheDirectory(configuration.get(), toWK(profileFolder + "\\Cache").get());
+                WKWebsiteDataStoreConfigurationSetCacheStorageDirectory(configuration.get(), toWK(profileFolder + "\\CacheStorage").get());
+                WKWebsiteDataStoreConfigurationSetIndexedDBDatabaseDirectory(configuration.get(), toWK(profileFolder + "\\Databases" + "\\IndexedDB").get());
+                WKWebsiteDataStoreConfigurationSetLocalStorageDirectory(configuration.get(), toWK(profileFolder + "\\LocalStorage").get());
+                WKWebsiteDataStoreConfigurationSetWebSQLDatabaseDirectory(configuration.get(), toWK(profileFolder + "\\Databases" + "\\WebSQL").get());
+                WKWebsiteDataStoreConfigurationSetMediaKeysStorageDirectory(configuration.get(), toWK(profileFolder + "\\MediaKeys").get());
+                WKWebsiteDataStoreConfigurationSetResourceLoadStatisticsDirectory(configuration.get(), toWK(profileFolder + "\\ResourceLoadStatistics").get());
+                WKWebsiteDataStoreConfigurationSetServiceWorkerRegistrationDirectory(configuration.get(), toWK(profileFolder + "\\ServiceWorkers").get());
+            }
+            dataStore = adoptWK(WKWebsiteDataStoreCreateWithConfiguration(configuration.get()));
+        }
         WKContextSetPrimaryDataStore(context.get(), dataStore.get());
-        configureDataStore(dataStore.get());
+        configureDataStore(context.get(), dataStore.get());
 
         auto* mainWindow = new MainWindow();
         auto conf = adoptWK(WKPageConfigurationCreate());
@@ -134,25 +141,40 @@ int WINAPI wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
             mainWindow->loadURL(g_options.requestedURL.GetBSTR());
         else
             mainWindow->loadURL(L"about:blank");
+        traceStartupPhase("startup window");
     }
 
-    hAccelTable = LoadAccelerators(hInst, MAKEINTRESOURCE(IDC_PLAYWRIGHT));
-    hPreAccelTable = LoadAccelerators(hInst, MAKEINTRESOURCE(IDR_ACCELERATORS_PRE));
+    // Accelerators drive the menus and the toolbar, headless windows have
+    // neither.
+    if (!g_options.headless) {
+        hAccelTable = LoadAccelerators(hInst, MAKEINTRESOURCE(IDC_PLAYWRIGHT));
+        hPreAccelTable = LoadAccelerators(hInst, MAKEINTRESOURCE(IDR_ACCELERATORS_PRE));
+    }
+    traceStartupPhase("message loop");
 
 #pragma warning(disable:4509)
 
     // Main message loop:
     __try {
-        while (GetMessage(&msg, nullptr, 0, 0)) {
-            if (TranslateAccelerator(msg.hwnd, hPreAccelTable, &msg))
-                continue;
-            bool processed = false;
-            if (MainWindow::isInstance(msg.hwnd))
-                processed = TranslateAccelerator(msg.hwnd, hAccelTable, &msg);
-            if (!processed) {
+        if (g_options.headless) {
+            // Input and inspector traffic go straight to dispatch, no
+            // accelerator applies to headless windows.
+            while (GetMessage(&msg, nullptr, 0, 0)) {
                 TranslateMessage(&msg);
                 DispatchMessage(&msg);
             }
+        } else {
+            while (GetMessage(&msg, nullptr, 0, 0)) {
+                if (TranslateAccelerator(msg.hwnd, hPreAccelTable, &msg))
+                    continue;
+                bool processed = false;
+                if (MainWindow::isInstance(msg.hwnd))
+                    processed = TranslateAccelerator(msg.hwnd, hAccelTable, &msg);
+                if (!processed) {
+                    TranslateMessage(&msg);
+                    DispatchMessage(&msg);
+                }
+            }
         }
     } __except(createCrashReport(GetExceptionInformation()), EXCEPTION_EXECUTE_HANDLER) { }
 